@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "filter.h"
+#include "jpegio.h"
+#include "imagebuf.h"
+
+//Append inName, and outDir/<file name of inName> as its output
+static int addImage(struct batch *b, const char *inName, const char *outDir)
+{
+	const char *name = strrchr(inName, '/');
+	char **inputs, **outputs;
+
+	name = name != NULL ? name + 1 : inName;
+
+	inputs = (char **)realloc(b->inputs, (b->count + 1) * sizeof(char *));
+	if (inputs == NULL)
+		return -1;
+	b->inputs = inputs;
+
+	outputs = (char **)realloc(b->outputs, (b->count + 1) * sizeof(char *));
+	if (outputs == NULL)
+		return -1;
+	b->outputs = outputs;
+
+	b->inputs[b->count] = strdup(inName);
+	b->outputs[b->count] = (char *)malloc(strlen(outDir) + strlen(name) + 2);
+	if (b->inputs[b->count] == NULL || b->outputs[b->count] == NULL)
+		return -1;
+	sprintf(b->outputs[b->count], "%s/%s", outDir, name);
+	b->count++;
+
+	return 0;
+}
+
+static int isJpeg(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+
+	return dot != NULL && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+}
+
+static int compareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int readDirectory(const char *source, const char *outDir, struct batch *b)
+{
+	DIR *dir = opendir(source);
+	struct dirent *entry;
+	char **names = NULL;
+	int count = 0;
+	int result = 0;
+
+	if (dir == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", source);
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.' || !isJpeg(entry->d_name))
+			continue;
+
+		char **grown = (char **)realloc(names, (count + 1) * sizeof(char *));
+		if (grown == NULL)
+		{
+			result = -1;
+			break;
+		}
+		names = grown;
+		names[count] = (char *)malloc(strlen(source) + strlen(entry->d_name) + 2);
+		if (names[count] == NULL)
+		{
+			result = -1;
+			break;
+		}
+		sprintf(names[count++], "%s/%s", source, entry->d_name);
+	}
+	closedir(dir);
+
+	// the same order on every rank and every run
+	qsort(names, count, sizeof(char *), compareNames);
+
+	for (int k = 0; k < count; k++)
+	{
+		if (result == 0)
+			result = addImage(b, names[k], outDir);
+		free(names[k]);
+	}
+	free(names);
+
+	return result;
+}
+
+static int readManifest(const char *source, const char *outDir, struct batch *b)
+{
+	FILE *manifest = fopen(source, "r");
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	int result = 0;
+
+	if (manifest == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", source);
+		return -1;
+	}
+
+	while (result == 0 && (length = getline(&line, &capacity, manifest)) != -1)
+	{
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			line[--length] = '\0';
+
+		// empty lines and comments
+		if (length == 0 || line[0] == '#')
+			continue;
+
+		result = addImage(b, line, outDir);
+	}
+
+	free(line);
+	fclose(manifest);
+
+	return result;
+}
+
+//Check that no two inputs write the same output, like a/x.jpg and b/x.jpg
+//of a manifest; the workers would write that file at the same time
+//An output can't be its own input either, as when outDir is the source
+static int checkOutputs(struct batch *b)
+{
+	char **names = (char **)malloc((b->count + 1) * sizeof(char *));
+	int result = 0;
+
+	if (names == NULL)
+		return -1;
+
+	for (int k = 0; k < b->count; k++)
+	{
+		struct stat in, out;
+
+		if (stat(b->inputs[k], &in) == 0 && stat(b->outputs[k], &out) == 0 &&
+			in.st_dev == out.st_dev && in.st_ino == out.st_ino)
+		{
+			fprintf(stderr, "%s would overwrite its input\n", b->outputs[k]);
+			result = -1;
+		}
+	}
+
+	memcpy(names, b->outputs, b->count * sizeof(char *));
+	qsort(names, b->count, sizeof(char *), compareNames);
+
+	for (int k = 1; k < b->count; k++)
+	{
+		if (strcmp(names[k - 1], names[k]) == 0)
+		{
+			fprintf(stderr, "two inputs write %s\n", names[k]);
+			result = -1;
+		}
+	}
+	free(names);
+
+	return result;
+}
+
+int readBatch(const char *source, const char *outDir, struct batch *b)
+{
+	struct stat info;
+	int result;
+
+	b->count = 0;
+	b->inputs = NULL;
+	b->outputs = NULL;
+	b->large = NULL;
+
+	if (stat(source, &info) != 0)
+	{
+		fprintf(stderr, "can't open %s\n", source);
+		return -1;
+	}
+
+	if (S_ISDIR(info.st_mode))
+		result = readDirectory(source, outDir, b);
+	else
+		result = readManifest(source, outDir, b);
+
+	if (result == 0)
+		result = checkOutputs(b);
+
+	return result;
+}
+
+int classifyBatch(struct batch *b)
+{
+	unsigned long width, height;
+
+	b->large = (char *)calloc(b->count + 1, sizeof(char));
+	if (b->large == NULL)
+		return -1;
+
+	// an image that can't be read stays small; filterImage fails on it
+	// again and the batch counts it then
+	for (int k = 0; k < b->count; k++)
+		b->large[k] = readSize(b->inputs[k], &width, &height) == 0 &&
+					  width * height >= BATCH_LARGE_PIXELS;
+
+	return 0;
+}
+
+void freeBatch(struct batch *b)
+{
+	for (int k = 0; k < b->count; k++)
+	{
+		free(b->inputs[k]);
+		free(b->outputs[k]);
+	}
+	free(b->inputs);
+	free(b->outputs);
+	free(b->large);
+}
+
+int filterImage(const char *inName, const char *outName)
+{
+	unsigned long width, height;
+	struct jpegWriter writer;
+	int result = -1;
+
+	if (readSize(inName, &width, &height) != 0)
+		return -1;
+
+	unsigned long size = imageComponents * width * height;
+	unsigned char *in = allocImage(size);
+	unsigned char *out = allocImage(size);
+
+	if (in != NULL && out != NULL &&
+		readRows(inName, 0, height, in) == 0 &&
+		openWriter(&writer, outName, width, height) == 0)
+	{
+		filterRows(in, out, width, height, imageComponents, 0, height);
+		writeRows(&writer, out, height);
+		closeWriter(&writer);
+		result = 0;
+	}
+
+	freeImage(in);
+	freeImage(out);
+
+	return result;
+}
+
+double getTime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void reportBatch(int count, int failed, double seconds)
+{
+	printf("%d images in %.3f s, %.1f images/s, %d failed\n", count, seconds,
+		   seconds > 0 ? count / seconds : 0.0, failed);
+}
@@ -0,0 +1,42 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Images with at least this many pixels are filtered by all the workers
+// together; smaller ones are filtered whole, several at once
+#define BATCH_LARGE_PIXELS (8UL << 20)
+
+// Input and output files of a batch run
+struct batch
+{
+	int count;
+	char **inputs;
+	char **outputs;
+	char *large;		// set by classifyBatch
+};
+
+//Collect the images of source, either a directory (its .jpg and .jpeg
+//files, sorted by name) or a manifest with one input path per line;
+//every output goes to outDir under the name of its input
+//Returns 0 on success and -1 on error, if two inputs share a file name or if
+//an output is its own input
+int readBatch(const char *source, const char *outDir, struct batch *b);
+
+//Read the size of every image and mark the ones of BATCH_LARGE_PIXELS or more;
+//images that can't be read are left to fail, and be counted, as small ones
+//Returns 0 on success and -1 if out of memory
+int classifyBatch(struct batch *b);
+
+void freeBatch(struct batch *b);
+
+//Decode, filter and encode one image on the calling thread
+//Returns 0 on success and -1 on error
+int filterImage(const char *inName, const char *outName);
+
+//Wall clock time in seconds
+double getTime(void);
+
+//Print the number of images filtered, the throughput of a run and the
+//number of images that failed
+void reportBatch(int count, int failed, double seconds);
+
+#endif
@@ -0,0 +1,73 @@
+#include "bigmpi.h"
+
+enum {
+	BIG_BCAST,
+	BIG_SEND,
+	BIG_RECV
+};
+
+//Post the transfer of one segment
+static int postSegment(int kind, unsigned char *buf, int count, int peer, int tag,
+					   MPI_Comm comm, MPI_Request *request)
+{
+	switch (kind)
+	{
+	case BIG_BCAST:
+		return MPI_Ibcast(buf, count, MPI_BYTE, peer, comm, request);
+	case BIG_SEND:
+		return MPI_Isend(buf, count, MPI_BYTE, peer, tag, comm, request);
+	default:
+		return MPI_Irecv(buf, count, MPI_BYTE, peer, tag, comm, request);
+	}
+}
+
+//Move size bytes as a chain of BIG_SEGMENT messages with at most BIG_DEPTH
+//of them posted; segments of one peer and tag are matched in order
+static int transfer(int kind, unsigned char *buf, unsigned long size, int peer, int tag, MPI_Comm comm)
+{
+	MPI_Request requests[BIG_DEPTH];
+	unsigned long segments = (size + BIG_SEGMENT - 1) / BIG_SEGMENT;
+	int result = MPI_SUCCESS;
+
+	for (unsigned long k = 0; k < segments; k++)
+	{
+		int slot = k % BIG_DEPTH;
+		unsigned long offset = k * BIG_SEGMENT;
+		int count = (int)(size - offset < BIG_SEGMENT ? size - offset : BIG_SEGMENT);
+
+		// the slot is reused, wait for the segment posted BIG_DEPTH ago
+		if (k >= BIG_DEPTH)
+		{
+			result = MPI_Wait(&requests[slot], MPI_STATUS_IGNORE);
+			if (result != MPI_SUCCESS)
+				return result;
+		}
+
+		result = postSegment(kind, buf + offset, count, peer, tag, comm, &requests[slot]);
+		if (result != MPI_SUCCESS)
+			return result;
+	}
+
+	// the last segments, at most BIG_DEPTH of them
+	unsigned long first = segments > BIG_DEPTH ? segments - BIG_DEPTH : 0;
+
+	for (unsigned long k = first; k < segments && result == MPI_SUCCESS; k++)
+		result = MPI_Wait(&requests[k % BIG_DEPTH], MPI_STATUS_IGNORE);
+
+	return result;
+}
+
+int bigBcast(void *buf, unsigned long size, int root, MPI_Comm comm)
+{
+	return transfer(BIG_BCAST, (unsigned char *)buf, size, root, 0, comm);
+}
+
+int bigSend(const void *buf, unsigned long size, int dest, int tag, MPI_Comm comm)
+{
+	return transfer(BIG_SEND, (unsigned char *)buf, size, dest, tag, comm);
+}
+
+int bigRecv(void *buf, unsigned long size, int source, int tag, MPI_Comm comm)
+{
+	return transfer(BIG_RECV, (unsigned char *)buf, size, source, tag, comm);
+}
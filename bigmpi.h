@@ -0,0 +1,25 @@
+#ifndef BIGMPI_H
+#define BIGMPI_H
+
+#include <mpi.h>
+
+// Bytes moved by one message of a large transfer; far below INT_MAX and
+// large enough that the per message overhead is small next to the copy
+#define BIG_SEGMENT (4UL << 20)
+
+// Segments kept in flight at once, so a rank forwards one segment while it
+// receives the next
+#define BIG_DEPTH 4
+
+//Broadcast size bytes from root to every rank of comm, for any size
+//Returns MPI_SUCCESS or the first MPI error
+int bigBcast(void *buf, unsigned long size, int root, MPI_Comm comm);
+
+//Send size bytes to dest; the matching receive must use bigRecv with the
+//same size and tag
+int bigSend(const void *buf, unsigned long size, int dest, int tag, MPI_Comm comm);
+
+//Receive size bytes sent with bigSend
+int bigRecv(void *buf, unsigned long size, int source, int tag, MPI_Comm comm);
+
+#endif
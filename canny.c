@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "canny.h"
+
+// Largest |gx| + |gy| of the Sobel operator
+#define MAX_MAGNITUDE 2040
+
+int parseThresholds(const char *arg, int *low, int *high)
+{
+	char extra;
+
+	if (sscanf(arg, "%d:%d%c", low, high, &extra) != 2 ||
+		*low < 0 || *low > *high || *high > MAX_MAGNITUDE)
+		return -1;
+
+	return 0;
+}
+
+int cannyAlloc(struct canny *c, unsigned long width, unsigned long height,
+			   unsigned long first, unsigned long last, int low, int high)
+{
+	unsigned long size = (last - first) * width + 1;
+
+	c->width = width;
+	c->height = height;
+	c->first = first;
+	c->rows = last - first;
+	c->low = low;
+	c->high = high;
+	c->gray = (unsigned char *) malloc(size * sizeof(unsigned char));
+	c->smooth = (unsigned char *) malloc(size * sizeof(unsigned char));
+	c->magnitude = (unsigned short *) malloc(size * sizeof(unsigned short));
+	c->direction = (unsigned char *) malloc(size * sizeof(unsigned char));
+	c->edges = (unsigned char *) malloc(size * sizeof(unsigned char));
+
+	if (c->gray == NULL || c->smooth == NULL || c->magnitude == NULL ||
+		c->direction == NULL || c->edges == NULL)
+	{
+		cannyFree(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+void cannyFree(struct canny *c)
+{
+	free(c->gray);
+	free(c->smooth);
+	free(c->magnitude);
+	free(c->direction);
+	free(c->edges);
+	c->gray = NULL;
+	c->smooth = NULL;
+	c->magnitude = NULL;
+	c->direction = NULL;
+	c->edges = NULL;
+}
+
+//Offset of an image row in the buffers
+static unsigned long rowOffset(struct canny *c, unsigned long row)
+{
+	return (row - c->first) * c->width;
+}
+
+void cannyGray(struct canny *c, const unsigned char *pixels, int channels,
+			   unsigned long start, unsigned long end)
+{
+	if (channels == 1)
+	{
+		memcpy(c->gray + rowOffset(c, start), pixels, (end - start) * c->width);
+		return;
+	}
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *src = pixels + (i - start) * 3 * c->width;
+		unsigned char *dst = c->gray + rowOffset(c, i);
+
+		for (unsigned long j = 0; j < c->width; j++)
+			dst[j] = (unsigned char)((77 * src[3 * j] + 150 * src[3 * j + 1] + 29 * src[3 * j + 2] + 128) >> 8);
+	}
+}
+
+void cannySmooth(struct canny *c, unsigned long start, unsigned long end)
+{
+	unsigned long w = c->width;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = c->gray + rowOffset(c, i);
+		unsigned char *dst = c->smooth + rowOffset(c, i);
+
+		//Border rows and columns
+		if (i < 1 || i >= c->height - 1 || w < 3)
+		{
+			memcpy(dst, row, w);
+			continue;
+		}
+		dst[0] = row[0];
+		dst[w - 1] = row[w - 1];
+
+		const unsigned char *above = row - w;
+		const unsigned char *below = row + w;
+
+		for (unsigned long j = 1; j < w - 1; j++)
+		{
+			int sum = above[j - 1] + 2 * above[j] + above[j + 1] +
+					  2 * (row[j - 1] + 2 * row[j] + row[j + 1]) +
+					  below[j - 1] + 2 * below[j] + below[j + 1];
+
+			dst[j] = (unsigned char)((sum + 8) >> 4);
+		}
+	}
+}
+
+void cannyGradient(struct canny *c, unsigned long start, unsigned long end)
+{
+	unsigned long w = c->width;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = c->smooth + rowOffset(c, i);
+		unsigned short *mag = c->magnitude + rowOffset(c, i);
+		unsigned char *dir = c->direction + rowOffset(c, i);
+
+		//No gradient on the border
+		if (i < 1 || i >= c->height - 1 || w < 3)
+		{
+			memset(mag, 0, w * sizeof(unsigned short));
+			memset(dir, 0, w);
+			continue;
+		}
+		mag[0] = mag[w - 1] = 0;
+		dir[0] = dir[w - 1] = 0;
+
+		const unsigned char *above = row - w;
+		const unsigned char *below = row + w;
+
+		for (unsigned long j = 1; j < w - 1; j++)
+		{
+			int gx = (above[j + 1] + 2 * row[j + 1] + below[j + 1]) -
+					 (above[j - 1] + 2 * row[j - 1] + below[j - 1]);
+			int gy = (below[j - 1] + 2 * below[j] + below[j + 1]) -
+					 (above[j - 1] + 2 * above[j] + above[j + 1]);
+			int ax = abs(gx);
+			int ay = abs(gy);
+
+			mag[j] = (unsigned short)(ax + ay);
+
+			// 0: horizontal, 2: vertical, 1 and 3: the diagonals
+			// tan(22.5) = 0.4142, tan(67.5) = 2.4142
+			if (ay * 10000 <= ax * 4142)
+				dir[j] = 0;
+			else if (ay * 10000 >= ax * 24142)
+				dir[j] = 2;
+			else
+				dir[j] = (gx > 0) == (gy > 0) ? 1 : 3;
+		}
+	}
+}
+
+void cannySuppress(struct canny *c, unsigned long start, unsigned long end)
+{
+	long w = (long)c->width;
+	// neighbours along the gradient, for every direction
+	const long step[4] = {1, w + 1, w, w - 1};
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned short *mag = c->magnitude + rowOffset(c, i);
+		const unsigned char *dir = c->direction + rowOffset(c, i);
+		unsigned char *dst = c->edges + rowOffset(c, i);
+
+		memset(dst, EDGE_NONE, w);
+		if (i < 1 || i >= c->height - 1 || w < 3)
+			continue;
+
+		for (long j = 1; j < w - 1; j++)
+		{
+			int m = mag[j];
+			long s = step[dir[j]];
+
+			if (m < c->low)
+				continue;
+
+			// ties keep the first pixel only, so plateaus stay one pixel wide
+			if (m > mag[j - s] && m >= mag[j + s])
+				dst[j] = m >= c->high ? EDGE_STRONG : EDGE_WEAK;
+		}
+	}
+}
+
+static void pushSeed(struct seedList *stack, unsigned long item)
+{
+	if (stack->count == stack->capacity)
+	{
+		unsigned long capacity = stack->capacity > 0 ? 2 * stack->capacity : 4096;
+		unsigned long *items = (unsigned long *) realloc(stack->items, capacity * sizeof(unsigned long));
+
+		if (items == NULL)
+		{
+			fprintf(stderr, "can't allocate the hysteresis stack\n");
+			exit(1);
+		}
+		stack->items = items;
+		stack->capacity = capacity;
+	}
+
+	stack->items[stack->count++] = item;
+}
+
+void cannyGrow(struct canny *c, unsigned long start, unsigned long end, struct seedList *stack)
+{
+	unsigned char *edges = c->edges;
+	unsigned long w = c->width;
+	unsigned long lo = rowOffset(c, start);
+	unsigned long hi = rowOffset(c, end);
+
+	for (unsigned long k = 0; k < stack->count; k++)
+		edges[stack->items[k]] = EDGE_STRONG;
+
+	while (stack->count > 0)
+	{
+		unsigned long p = stack->items[--stack->count];
+		unsigned long col = p % w;
+
+		for (long dr = -1; dr <= 1; dr++)
+		{
+			// rows outside the strip belong to someone else
+			if ((dr < 0 && p < lo + w) || (dr > 0 && p + w >= hi))
+				continue;
+
+			for (long dc = -1; dc <= 1; dc++)
+			{
+				if ((dc < 0 && col == 0) || (dc > 0 && col == w - 1))
+					continue;
+
+				unsigned long q = p + dr * (long)w + dc;
+
+				if (edges[q] == EDGE_WEAK)
+				{
+					edges[q] = EDGE_STRONG;
+					pushSeed(stack, q);
+				}
+			}
+		}
+	}
+}
+
+void cannyStart(struct canny *c, unsigned long start, unsigned long end, struct seedList *stack)
+{
+	unsigned long hi = rowOffset(c, end);
+
+	stack->count = 0;
+	for (unsigned long p = rowOffset(c, start); p < hi; p++)
+		if (c->edges[p] == EDGE_STRONG)
+			pushSeed(stack, p);
+
+	cannyGrow(c, start, end, stack);
+}
+
+//Weak pixels of row that touch a strong pixel of the row next to it
+static void touching(struct canny *c, unsigned long row, unsigned long next, struct seedList *stack)
+{
+	const unsigned char *edges = c->edges + rowOffset(c, row);
+	const unsigned char *other = c->edges + rowOffset(c, next);
+	unsigned long w = c->width;
+
+	for (unsigned long j = 0; j < w; j++)
+	{
+		if (edges[j] != EDGE_WEAK)
+			continue;
+
+		if (other[j] == EDGE_STRONG || (j > 0 && other[j - 1] == EDGE_STRONG) ||
+			(j + 1 < w && other[j + 1] == EDGE_STRONG))
+			pushSeed(stack, rowOffset(c, row) + j);
+	}
+}
+
+unsigned long cannySeeds(struct canny *c, unsigned long start, unsigned long end, struct seedList *stack)
+{
+	stack->count = 0;
+	if (start >= end)
+		return 0;
+
+	if (start > 0)
+		touching(c, start, start - 1, stack);
+	if (end < c->height)
+		touching(c, end - 1, end, stack);
+
+	return stack->count;
+}
+
+void freeSeeds(struct seedList *stack)
+{
+	free(stack->items);
+	stack->items = NULL;
+	stack->count = 0;
+	stack->capacity = 0;
+}
+
+unsigned long edgeRowSize(unsigned long width)
+{
+	return (width + 7) / 8;
+}
+
+void cannyPack(struct canny *c, unsigned long start, unsigned long end, unsigned char *packed)
+{
+	unsigned long rowSize = edgeRowSize(c->width);
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *edges = c->edges + rowOffset(c, i);
+		unsigned char *dst = packed + (i - start) * rowSize;
+
+		memset(dst, 0, rowSize);
+		for (unsigned long j = 0; j < c->width; j++)
+			if (edges[j] == EDGE_STRONG)
+				dst[j / 8] |= 0x80 >> (j % 8);
+	}
+}
+
+int edgeMapHeader(char *header, int size, unsigned long width, unsigned long height)
+{
+	return snprintf(header, size, "P4\n%lu %lu\n", width, height);
+}
+
+int writeEdgeMap(struct canny *c, const char *fileName)
+{
+	char header[64];
+	int headerSize = edgeMapHeader(header, sizeof(header), c->width, c->height);
+	unsigned long rowSize = edgeRowSize(c->width);
+	unsigned char *packed = (unsigned char *) malloc(rowSize * sizeof(unsigned char));
+	FILE *output = fopen(fileName, "wb");
+	int result = 0;
+
+	if (output == NULL || packed == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", fileName);
+		if (output != NULL)
+			fclose(output);
+		free(packed);
+		return -1;
+	}
+
+	if (fwrite(header, 1, headerSize, output) != (size_t)headerSize)
+		result = -1;
+
+	for (unsigned long i = 0; i < c->height && result == 0; i++)
+	{
+		cannyPack(c, i, i + 1, packed);
+		if (fwrite(packed, 1, rowSize, output) != rowSize)
+			result = -1;
+	}
+
+	if (fclose(output) != 0)
+		result = -1;
+	free(packed);
+
+	return result;
+}
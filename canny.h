@@ -0,0 +1,92 @@
+#ifndef CANNY_H
+#define CANNY_H
+
+// Canny edge detector in stages over ranges of rows, so every backend can
+// split the image its own way: grayscale, 3x3 Gaussian blur, Sobel
+// gradient, non maximum suppression with a double threshold and hysteresis
+
+// Rows of input a range of rows needs above and below it: one for the blur,
+// one for the gradient and one for the suppression
+#define CANNY_HALO 3
+
+// Values of the edge map before hysteresis
+#define EDGE_NONE 0
+#define EDGE_WEAK 1
+#define EDGE_STRONG 2
+
+// Buffers of the stages, for image rows [first, first + rows)
+struct canny
+{
+	unsigned long width;
+	unsigned long height;
+	unsigned long first;
+	unsigned long rows;
+	int low;
+	int high;
+	unsigned char *gray;
+	unsigned char *smooth;
+	unsigned short *magnitude;	// |gx| + |gy|
+	unsigned char *direction;	// gradient direction, in 45 degree steps
+	unsigned char *edges;
+};
+
+// Pixel indices, used as seeds and as the flood fill stack of hysteresis
+struct seedList
+{
+	unsigned long *items;
+	unsigned long count;
+	unsigned long capacity;
+};
+
+//Parse the "low:high" thresholds of the gradient magnitude (0 - 2040)
+//Returns 0 on success and -1 on a malformed argument
+int parseThresholds(const char *arg, int *low, int *high);
+
+//Allocate the buffers for image rows [first, last)
+//Returns 0 on success and -1 if they can't be allocated
+int cannyAlloc(struct canny *c, unsigned long width, unsigned long height,
+			   unsigned long first, unsigned long last, int low, int high);
+
+void cannyFree(struct canny *c);
+
+//Luminance of rows [start, end); pixels points to row start and has
+//channels 3 (RGB) or 1 (luminance already, copied)
+void cannyGray(struct canny *c, const unsigned char *pixels, int channels,
+			   unsigned long start, unsigned long end);
+
+//Blur rows [start, end); needs the gray rows around them
+void cannySmooth(struct canny *c, unsigned long start, unsigned long end);
+
+//Gradient of rows [start, end); needs the smooth rows around them
+void cannyGradient(struct canny *c, unsigned long start, unsigned long end);
+
+//Thin the edges of rows [start, end) to the local maxima along the gradient
+//and mark them weak or strong; needs the gradient rows around them
+void cannySuppress(struct canny *c, unsigned long start, unsigned long end);
+
+//Hysteresis inside a strip [start, end): cannyStart grows every strong
+//pixel of the strip into its weak neighbours; cannySeeds collects the weak
+//pixels of the first and last row that touch a strong pixel of the strips
+//around it (read only, returns their number); cannyGrow marks the seeds
+//strong and grows them. Only the rows of the strip are written, so strips
+//can run at once as long as cannySeeds and cannyGrow don't overlap
+void cannyStart(struct canny *c, unsigned long start, unsigned long end, struct seedList *stack);
+unsigned long cannySeeds(struct canny *c, unsigned long start, unsigned long end, struct seedList *stack);
+void cannyGrow(struct canny *c, unsigned long start, unsigned long end, struct seedList *stack);
+
+void freeSeeds(struct seedList *stack);
+
+//Bytes per row of the edge map, one bit per pixel
+unsigned long edgeRowSize(unsigned long width);
+
+//Pack the strong pixels of rows [start, end) into PBM rows, 1 for an edge
+void cannyPack(struct canny *c, unsigned long start, unsigned long end, unsigned char *packed);
+
+//PBM (P4) header of a width x height edge map; returns its length
+int edgeMapHeader(char *header, int size, unsigned long width, unsigned long height);
+
+//Write the edge map of the whole image held by c to fileName
+//Returns 0 on success and -1 on error
+int writeEdgeMap(struct canny *c, const char *fileName);
+
+#endif
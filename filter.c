@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "filter.h"
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+// Edge detection (sum /= 16); -k log smooths with a 3x3 Gaussian first
+int edgeDetectionFilter[3][3] = {{-1, -1, -1},
+								 {-1, 8, -1},
+								 {-1, -1, -1}};
+
+static int filterMode = FILTER_SIMD;
+
+// Kernel loaded with setFilterKernel; the edge detection filter has the
+// fast paths below and needs no engine
+static struct kernel activeKernel;
+static int customKernel = 0;
+
+// Tile size of the tiled mode, set from the cache sizes by setFilterMode
+static unsigned long tileBytes = 4096;
+static unsigned long tileRows = 64;
+
+//Compute sum of neighbours product
+static int computeSum(const unsigned char *rows[3], unsigned long column, int channels)
+{
+	int sum = 0;
+	unsigned long colIdx = column - channels;
+
+	for (unsigned long fi = 0; fi < 3; fi++)
+	{
+		for (unsigned long j = colIdx, fj = 0; fj < 3; j += channels, fj++)
+		{
+			sum += (int)(rows[fi][j]) * edgeDetectionFilter[fi][fj];
+		}
+	}
+
+	return sum;
+}
+
+//Scalar interior of a row, for columns [j, end)
+static void filterSpanScalar(const unsigned char *rows[3], unsigned char *out,
+							 unsigned long j, unsigned long end, int channels)
+{
+	for (; j < end; j++)
+		out[j] = (unsigned char)(computeSum(rows, j, channels) / 16);
+}
+
+#ifdef HAVE_X86_SIMD
+//The kernel is 9 * center - (3x3 box sum); |sum| <= 9 * 255, so 16 bit lanes
+//are enough. Division truncates towards zero like the scalar "sum / 16" and
+//the cast to unsigned char keeps the low byte.
+
+__attribute__((target("avx2")))
+static inline __m256i sum16AVX2(const unsigned char *a, const unsigned char *r,
+								const unsigned char *b, long c)
+{
+	__m256i center = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)r));
+	__m256i box = _mm256_add_epi16(
+		_mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a - c))),
+						 _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)a))),
+		_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + c))));
+
+	box = _mm256_add_epi16(box, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(r - c))));
+	box = _mm256_add_epi16(box, center);
+	box = _mm256_add_epi16(box, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(r + c))));
+	box = _mm256_add_epi16(box, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b - c))));
+	box = _mm256_add_epi16(box, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)b)));
+	box = _mm256_add_epi16(box, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + c))));
+
+	__m256i sum = _mm256_sub_epi16(_mm256_add_epi16(_mm256_slli_epi16(center, 3), center), box);
+
+	// round towards zero: add 15 to negative sums before the shift
+	sum = _mm256_add_epi16(sum, _mm256_and_si256(_mm256_srai_epi16(sum, 15), _mm256_set1_epi16(15)));
+	sum = _mm256_srai_epi16(sum, 4);
+
+	return _mm256_and_si256(sum, _mm256_set1_epi16(0xff));
+}
+
+__attribute__((target("avx2")))
+static unsigned long filterSpanAVX2(const unsigned char *rows[3], unsigned char *out,
+									unsigned long j, unsigned long end, int channels)
+{
+	for (; j + 32 <= end; j += 32)
+	{
+		__m256i lo = sum16AVX2(rows[0] + j, rows[1] + j, rows[2] + j, channels);
+		__m256i hi = sum16AVX2(rows[0] + j + 16, rows[1] + j + 16, rows[2] + j + 16, channels);
+
+		// packus works per 128 bit lane, restore the byte order afterwards
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i *)(out + j), packed);
+	}
+
+	return j;
+}
+
+static inline __m128i sum8SSE2(__m128i a0, __m128i a1, __m128i a2,
+							   __m128i r0, __m128i r1, __m128i r2,
+							   __m128i b0, __m128i b1, __m128i b2)
+{
+	__m128i box = _mm_add_epi16(_mm_add_epi16(a0, a1), _mm_add_epi16(a2, r0));
+	box = _mm_add_epi16(box, _mm_add_epi16(r1, r2));
+	box = _mm_add_epi16(box, _mm_add_epi16(_mm_add_epi16(b0, b1), b2));
+
+	__m128i sum = _mm_sub_epi16(_mm_add_epi16(_mm_slli_epi16(r1, 3), r1), box);
+
+	sum = _mm_add_epi16(sum, _mm_and_si128(_mm_srai_epi16(sum, 15), _mm_set1_epi16(15)));
+	sum = _mm_srai_epi16(sum, 4);
+
+	return _mm_and_si128(sum, _mm_set1_epi16(0xff));
+}
+
+static unsigned long filterSpanSSE2(const unsigned char *rows[3], unsigned char *out,
+									unsigned long j, unsigned long end, int channels)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v[9];
+
+	for (; j + 16 <= end; j += 16)
+	{
+		for (int k = 0; k < 9; k++)
+			v[k] = _mm_loadu_si128((const __m128i *)(rows[k / 3] + j + (k % 3 - 1) * channels));
+
+		__m128i lo = sum8SSE2(_mm_unpacklo_epi8(v[0], zero), _mm_unpacklo_epi8(v[1], zero),
+							  _mm_unpacklo_epi8(v[2], zero), _mm_unpacklo_epi8(v[3], zero),
+							  _mm_unpacklo_epi8(v[4], zero), _mm_unpacklo_epi8(v[5], zero),
+							  _mm_unpacklo_epi8(v[6], zero), _mm_unpacklo_epi8(v[7], zero),
+							  _mm_unpacklo_epi8(v[8], zero));
+		__m128i hi = sum8SSE2(_mm_unpackhi_epi8(v[0], zero), _mm_unpackhi_epi8(v[1], zero),
+							  _mm_unpackhi_epi8(v[2], zero), _mm_unpackhi_epi8(v[3], zero),
+							  _mm_unpackhi_epi8(v[4], zero), _mm_unpackhi_epi8(v[5], zero),
+							  _mm_unpackhi_epi8(v[6], zero), _mm_unpackhi_epi8(v[7], zero),
+							  _mm_unpackhi_epi8(v[8], zero));
+
+		_mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi16(lo, hi));
+	}
+
+	return j;
+}
+
+static unsigned long filterSpanSIMD(const unsigned char *rows[3], unsigned char *out,
+									unsigned long j, unsigned long end, int channels)
+{
+	if (__builtin_cpu_supports("avx2"))
+		j = filterSpanAVX2(rows, out, j, end, channels);
+
+	return filterSpanSSE2(rows, out, j, end, channels);
+}
+#endif
+
+//Interior of a row for columns [j, end), vectorized unless in scalar mode
+static void filterSpan(const unsigned char *rows[3], unsigned char *out,
+					   unsigned long j, unsigned long end, int channels)
+{
+#ifdef HAVE_X86_SIMD
+	if (filterMode != FILTER_SCALAR)
+		j = filterSpanSIMD(rows, out, j, end, channels);
+#endif
+	filterSpanScalar(rows, out, j, end, channels);
+}
+
+//A column strip of tileBytes keeps its three input rows and the output row
+//in half of L1 while it walks down a band; a band of tileRows rows keeps the
+//strip in half of L2, so the next band only misses on its two halo rows
+static void initTiles(void)
+{
+	long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+	long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+	if (l1 <= 0)
+		l1 = 32 * 1024;
+	if (l2 <= 0)
+		l2 = 1024 * 1024;
+
+	tileBytes = (unsigned long)l1 / 8 / 64 * 64;
+	if (tileBytes < 256)
+		tileBytes = 256;
+
+	tileRows = (unsigned long)l2 / 2 / (2 * tileBytes);
+	if (tileRows < 8)
+		tileRows = 8;
+}
+
+//Tiled version of filterRows: rows [start, end) are cut into bands of
+//tileRows and every band into column strips of tileBytes
+static void filterRowsTiled(const unsigned char *in, unsigned char *out,
+							unsigned long width, unsigned long height, int channels,
+							unsigned long start, unsigned long end)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+
+	for (unsigned long band = start; band < end; band += tileRows)
+	{
+		unsigned long bandEnd = band + tileRows < end ? band + tileRows : end;
+
+		for (unsigned long col = 0; col < rowSize; col += tileBytes)
+		{
+			unsigned long colEnd = col + tileBytes < rowSize ? col + tileBytes : rowSize;
+			unsigned long lo = col > (unsigned long)channels ? col : (unsigned long)channels;
+			unsigned long hi = colEnd < rowSize - channels ? colEnd : rowSize - channels;
+
+			for (unsigned long i = band; i < bandEnd; i++)
+			{
+				const unsigned char *row = in + (i - start) * rowSize;
+				unsigned char *dst = out + (i - start) * rowSize;
+
+				//Border rows and columns
+				if (i < 1 || i >= height - 1 || width < 3 || lo >= hi)
+				{
+					memcpy(dst + col, row + col, colEnd - col);
+					continue;
+				}
+				if (col < lo)
+					memcpy(dst + col, row + col, lo - col);
+				if (hi < colEnd)
+					memcpy(dst + hi, row + hi, colEnd - hi);
+
+				const unsigned char *rows[3] = {row - rowSize, row, row + rowSize};
+
+				filterSpan(rows, dst, lo, hi, channels);
+			}
+		}
+	}
+}
+
+//The kernel is also 9 * center - (3x3 box sum). colSum holds the vertical
+//sums of the three rows around the current one, the horizontal window of
+//three column sums slides along each channel, so no multiplies are needed
+static void filterRowBoxSum(const unsigned short *colSum, const unsigned char *row,
+							unsigned char *out, unsigned long rowSize, int channels)
+{
+	memcpy(out, row, channels);
+	memcpy(out + rowSize - channels, row + rowSize - channels, channels);
+
+	for (int ch = 0; ch < channels; ch++)
+	{
+		unsigned long j = ch + channels;
+		unsigned long last = rowSize - 2 * channels + ch;
+		int window = colSum[j - channels] + colSum[j] + colSum[j + channels];
+
+		for (; j < last; j += channels)
+		{
+			out[j] = (unsigned char)(((row[j] << 3) + row[j] - window) / 16);
+			window += colSum[j + 2 * channels] - colSum[j - channels];
+		}
+		out[last] = (unsigned char)(((row[last] << 3) + row[last] - window) / 16);
+	}
+}
+
+//Box sum version of filterRows; the column sums are carried from one row
+//to the next by adding the new bottom row and removing the old top row
+static void filterRowsBoxSum(const unsigned char *in, unsigned char *out,
+							 unsigned long width, unsigned long height, int channels,
+							 unsigned long start, unsigned long end)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned short *colSum = NULL;
+	int haveSums = 0;
+
+	if (width >= 3)
+		colSum = (unsigned short *)malloc(rowSize * sizeof(unsigned short));
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = in + (i - start) * rowSize;
+		unsigned char *dst = out + (i - start) * rowSize;
+
+		//Border rows and columns
+		if (i < 1 || i >= height - 1 || width < 3)
+		{
+			memcpy(dst, row, rowSize);
+			continue;
+		}
+
+		if (colSum == NULL)
+		{
+			filterRow(row - rowSize, row, row + rowSize, dst, width, channels);
+			continue;
+		}
+
+		const unsigned char *above = row - rowSize;
+		const unsigned char *below = row + rowSize;
+
+		if (!haveSums)
+		{
+			for (unsigned long j = 0; j < rowSize; j++)
+				colSum[j] = above[j] + row[j] + below[j];
+			haveSums = 1;
+		}
+		else
+		{
+			const unsigned char *gone = above - rowSize;
+
+			for (unsigned long j = 0; j < rowSize; j++)
+				colSum[j] += below[j] - gone[j];
+		}
+
+		filterRowBoxSum(colSum, row, dst, rowSize, channels);
+	}
+
+	free(colSum);
+}
+
+int setFilterKernel(const char *spec)
+{
+	struct kernel k;
+	int edge = 1;
+
+	if (loadKernel(spec, &k) != 0)
+		return -1;
+
+	if (k.size != 3 || k.divisor != 16 || k.next != NULL)
+		edge = 0;
+	for (int n = 0; n < 9 && edge; n++)
+		if (k.weights[n] != edgeDetectionFilter[n / 3][n % 3])
+			edge = 0;
+
+	if (customKernel)
+		freeKernel(&activeKernel);
+	customKernel = !edge;
+	if (edge)
+		freeKernel(&k);
+	else
+		activeKernel = k;
+
+	return 0;
+}
+
+int filterRadius(void)
+{
+	return customKernel ? kernelRadius(&activeKernel) : 1;
+}
+
+int setFilterMode(const char *name)
+{
+	if (strcmp(name, "scalar") == 0)
+		filterMode = FILTER_SCALAR;
+	else if (strcmp(name, "simd") == 0)
+		filterMode = FILTER_SIMD;
+	else if (strcmp(name, "boxsum") == 0)
+		filterMode = FILTER_BOXSUM;
+	else if (strcmp(name, "tiled") == 0)
+	{
+		filterMode = FILTER_TILED;
+		initTiles();
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+void filterRow(const unsigned char *above, const unsigned char *row,
+			   const unsigned char *below, unsigned char *out,
+			   unsigned long width, int channels)
+{
+	const unsigned char *rows[3] = {above, row, below};
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned long j = channels;
+
+	//Border columns
+	if (width < 3)
+	{
+		memcpy(out, row, rowSize);
+		return;
+	}
+	memcpy(out, row, channels);
+	memcpy(out + rowSize - channels, row + rowSize - channels, channels);
+
+	//Interior, no per pixel border checks
+	filterSpan(rows, out, j, rowSize - channels, channels);
+}
+
+void filterWindow(const unsigned char *const *rows, unsigned char *out,
+				  unsigned long width, int channels)
+{
+	if (customKernel)
+		convolveWindow(&activeKernel, rows, out, width, channels, filterMode != FILTER_SCALAR);
+	else
+		filterRow(rows[0], rows[1], rows[2], out, width, channels);
+}
+
+void filterRows(const unsigned char *in, unsigned char *out,
+				unsigned long width, unsigned long height, int channels,
+				unsigned long start, unsigned long end)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+
+	if (customKernel)
+	{
+		convolveRows(&activeKernel, in, out, width, height, channels, start, end,
+					 filterMode != FILTER_SCALAR);
+		return;
+	}
+	if (filterMode == FILTER_BOXSUM)
+	{
+		filterRowsBoxSum(in, out, width, height, channels, start, end);
+		return;
+	}
+	if (filterMode == FILTER_TILED)
+	{
+		filterRowsTiled(in, out, width, height, channels, start, end);
+		return;
+	}
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = in + (i - start) * rowSize;
+		unsigned char *dst = out + (i - start) * rowSize;
+
+		//Border rows
+		if (i < 1 || i >= height - 1)
+		{
+			memcpy(dst, row, rowSize);
+			continue;
+		}
+
+		filterRow(row - rowSize, row, row + rowSize, dst, width, channels);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+//pshufb masks that gather one channel of 16 RGB pixels out of the 16 byte
+//block s of their 48 bytes (toPlane), and the inverse (toPixels)
+static void layoutMasks(__m128i toPlane[3][3], __m128i toPixels[3][3])
+{
+	for (int s = 0; s < 3; s++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			char plane[16];
+			char pixels[16];
+
+			for (int k = 0; k < 16; k++)
+			{
+				int from = 3 * k + c;
+				int to = 16 * s + k;
+
+				plane[k] = from / 16 == s ? from % 16 : -128;
+				pixels[k] = to % 3 == c ? to / 3 : -128;
+			}
+			toPlane[s][c] = _mm_loadu_si128((const __m128i *)plane);
+			toPixels[s][c] = _mm_loadu_si128((const __m128i *)pixels);
+		}
+	}
+}
+
+//Split 16 RGB pixels at a time; returns the first pixel left over
+__attribute__((target("ssse3")))
+static unsigned long deinterleave3SSSE3(const unsigned char *row, unsigned char *r,
+										unsigned char *g, unsigned char *b, unsigned long width)
+{
+	__m128i toPlane[3][3];
+	__m128i toPixels[3][3];
+	unsigned char *planes[3] = {r, g, b};
+	unsigned long j = 0;
+
+	layoutMasks(toPlane, toPixels);
+
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i v[3];
+
+		for (int s = 0; s < 3; s++)
+			v[s] = _mm_loadu_si128((const __m128i *)(row + 3 * j + 16 * s));
+
+		for (int c = 0; c < 3; c++)
+		{
+			__m128i plane = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], toPlane[0][c]),
+													  _mm_shuffle_epi8(v[1], toPlane[1][c])),
+										 _mm_shuffle_epi8(v[2], toPlane[2][c]));
+
+			_mm_storeu_si128((__m128i *)(planes[c] + j), plane);
+		}
+	}
+
+	return j;
+}
+
+//Join 16 pixels of the R, G and B planes at a time
+__attribute__((target("ssse3")))
+static unsigned long interleave3SSSE3(const unsigned char *r, const unsigned char *g,
+									  const unsigned char *b, unsigned char *row, unsigned long width)
+{
+	__m128i toPlane[3][3];
+	__m128i toPixels[3][3];
+	const unsigned char *planes[3] = {r, g, b};
+	unsigned long j = 0;
+
+	layoutMasks(toPlane, toPixels);
+
+	for (; j + 16 <= width; j += 16)
+	{
+		__m128i v[3];
+
+		for (int c = 0; c < 3; c++)
+			v[c] = _mm_loadu_si128((const __m128i *)(planes[c] + j));
+
+		for (int s = 0; s < 3; s++)
+		{
+			__m128i pixels = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], toPixels[s][0]),
+													   _mm_shuffle_epi8(v[1], toPixels[s][1])),
+										  _mm_shuffle_epi8(v[2], toPixels[s][2]));
+
+			_mm_storeu_si128((__m128i *)(row + 3 * j + 16 * s), pixels);
+		}
+	}
+
+	return j;
+}
+#endif
+
+void deinterleaveRows(const unsigned char *in, unsigned char *planes,
+					  unsigned long width, unsigned long height, int channels,
+					  unsigned long start, unsigned long end)
+{
+	unsigned long planeSize = width * height;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = in + (i - start) * channels * width;
+		unsigned char *dst = planes + i * width;
+		unsigned long j = 0;
+
+#ifdef HAVE_X86_SIMD
+		if (channels == 3 && filterMode != FILTER_SCALAR && __builtin_cpu_supports("ssse3"))
+			j = deinterleave3SSSE3(row, dst, dst + planeSize, dst + 2 * planeSize, width);
+#endif
+		for (; j < width; j++)
+			for (int c = 0; c < channels; c++)
+				dst[c * planeSize + j] = row[j * channels + c];
+	}
+}
+
+void interleaveRows(const unsigned char *planes, unsigned char *out,
+					unsigned long width, unsigned long height, int channels,
+					unsigned long start, unsigned long end)
+{
+	unsigned long planeSize = width * height;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *src = planes + i * width;
+		unsigned char *row = out + (i - start) * channels * width;
+		unsigned long j = 0;
+
+#ifdef HAVE_X86_SIMD
+		if (channels == 3 && filterMode != FILTER_SCALAR && __builtin_cpu_supports("ssse3"))
+			j = interleave3SSSE3(src, src + planeSize, src + 2 * planeSize, row, width);
+#endif
+		for (; j < width; j++)
+			for (int c = 0; c < channels; c++)
+				row[j * channels + c] = src[c * planeSize + j];
+	}
+}
+
+void filterPlanes(const unsigned char *in, unsigned char *out,
+				  unsigned long width, unsigned long height, int channels,
+				  unsigned long start, unsigned long end)
+{
+	unsigned long planeSize = width * height;
+
+	for (int c = 0; c < channels; c++)
+		filterRows(in + c * planeSize + start * width, out + c * planeSize + start * width,
+				   width, height, 1, start, end);
+}
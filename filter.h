@@ -0,0 +1,73 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+// Largest kernel radius setFilterKernel accepts
+#define FILTER_MAX_RADIUS 15
+
+// Filter implementations, selected with setFilterMode
+enum {
+	FILTER_SCALAR,
+	FILTER_SIMD,
+	FILTER_BOXSUM,
+	FILTER_TILED
+};
+
+//Select the filter implementation by name ("scalar", "simd", "boxsum", "tiled")
+//"tiled" is simd over cache sized tiles, taken from the L1 and L2 sizes
+//Returns 0 on success and -1 for an unknown name
+int setFilterMode(const char *name);
+
+//Use another convolution kernel instead of the edge detection filter: a
+//built in name or a kernel file (see loadKernel in kernel.h)
+//The modes of setFilterMode apply to the edge detection filter; other
+//kernels take their own SIMD paths, or the scalar ones with "scalar"
+//Returns 0 on success and -1 on error
+int setFilterKernel(const char *spec);
+
+//Rows and columns of context the kernel needs on each side of a pixel;
+//that many rows and columns at the image border are copied unchanged
+int filterRadius(void);
+
+//Apply the filter on one interior row, given the rows above and below it
+//Only for the built in filter; -k kernels go through filterWindow
+//The first and last pixel of the row are copied unchanged
+//Single rows have no column sums to reuse, so boxsum and tiled fall back to simd here
+void filterRow(const unsigned char *above, const unsigned char *row,
+			   const unsigned char *below, unsigned char *out,
+			   unsigned long width, int channels);
+
+//Apply the filter on one interior row; rows holds the 2 * filterRadius() + 1
+//rows around it, top to bottom
+void filterWindow(const unsigned char *const *rows, unsigned char *out,
+				  unsigned long width, int channels);
+
+//Apply the filter on rows [start, end) of a width x height image
+//in and out point to row start; the filterRadius() rows above start and
+//below end - 1 must be readable through in unless they lie outside the image
+void filterRows(const unsigned char *in, unsigned char *out,
+				unsigned long width, unsigned long height, int channels,
+				unsigned long start, unsigned long end);
+
+// Planar layout: the channels of an image as separate width x height planes,
+// one after another, so the filter reads neighbouring pixels unit stride
+// and its vector lanes hold a single channel
+
+//Split rows [start, end) of an interleaved image into planes; in points to
+//row start, planes to the first plane
+void deinterleaveRows(const unsigned char *in, unsigned char *planes,
+					  unsigned long width, unsigned long height, int channels,
+					  unsigned long start, unsigned long end);
+
+//Join rows [start, end) of the planes back into interleaved rows; out points
+//to row start
+void interleaveRows(const unsigned char *planes, unsigned char *out,
+					unsigned long width, unsigned long height, int channels,
+					unsigned long start, unsigned long end);
+
+//filterRows on rows [start, end) of every plane; in and out point to the
+//first plane, and the rows around the range must be split already
+void filterPlanes(const unsigned char *in, unsigned char *out,
+				  unsigned long width, unsigned long height, int channels,
+				  unsigned long start, unsigned long end);
+
+#endif
@@ -1,12 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sched.h>
 #include "libjpeg/jpeglib.h"
+#include "filter.h"
+#include "jpegio.h"
+#include "bigmpi.h"
+#include "batch.h"
+#include "imagebuf.h"
 #include <mpi.h>
 #include <omp.h>
 
-// compilare mpicc -fopenmp -o hybrid hybrid.c -ljpeg
-// rulare mpirun -np <nr_proc> ./hybrid <image_in> <image_out>
+// compilare mpicc -O2 -fopenmp -o hybrid hybrid.c filter.c kernel.c jpegio.c bigmpi.c batch.c imagebuf.c -ljpeg
+// rulare mpirun -np <nr_proc> ./hybrid [-m scalar|simd|boxsum|tiled] [-k kernel] [-d] [-b] [-g] <image_in|batch> <image_out|dir>
 // ex. mpirun -np 4 ./hybrid in/house.pgm house_line.pgm
 
 typedef struct {
@@ -15,11 +22,45 @@ typedef struct {
 	unsigned char *data;
 } image;
 
-// Gaussian noise reduction (sum /= 16)
-int edgeDetectionFilter[3][3] = {{-1, -1, -1},
-								 {-1, 8, -1},
-								 {-1, -1, -1}};
 
+// Rows of halo needed above and below a strip, the radius of the kernel
+unsigned long halo = 1;
+
+// Rows sent to rank 0 in one message
+#define GATHER_ROWS 256
+
+// Receive buffers rank 0 keeps posted while it encodes
+#define GATHER_WINDOW 8
+
+// Rows one thread filters at a time; a gather block is a whole number of chunks
+#define CHUNK_ROWS 16
+
+// The blocks of ranks 1..P-1 in image order; rank 0 receives them through
+// a ring of GATHER_WINDOW buffers, so it never holds the whole output
+struct gather
+{
+	int count;
+	int *proc;
+	int *tag;
+	unsigned long *first;
+	unsigned long *last;
+	unsigned char **shared;		// rows in outWin for ranks on the node of rank 0
+	unsigned char *ring;
+	unsigned long slotSize;
+	MPI_Request requests[GATHER_WINDOW];
+};
+
+// Ranks on one node map a single copy of the input image (inWin) and keep
+// their output strips in one window (outWin); the ranks next to rank 0 only
+// tell it when a block is ready instead of sending the rows
+MPI_Comm nodeComm;
+MPI_Win inWin = MPI_WIN_NULL;
+MPI_Win outWin = MPI_WIN_NULL;
+int nearRoot = 0;
+
+// MPI may be called from the master thread while the others filter; without
+// MPI_THREAD_FUNNELED the blocks are only handed on after the filter
+int overlap = 1;
 
 //Get the interval to process
 void getInterval(unsigned long *start, unsigned long *end, int rank, int P, unsigned long height) {
@@ -30,177 +71,395 @@ void getInterval(unsigned long *start, unsigned long *end, int rank, int P, unsi
 		*end = height;
 } 
 
-//Read a given image
-void readInput(const char *fileName, image *img)
-{
-	FILE *input = NULL;
-	struct jpeg_decompress_struct info;
-	struct jpeg_error_mgr err;
+//Rows per gather block; large enough that the block index fits in a tag
+unsigned long getBlockRows(unsigned long height) {
+	unsigned long blockRows = GATHER_ROWS;
 
-	if (fileName == NULL ||
-		(input = fopen(fileName, "rb")) == NULL)
-	{
-		fprintf(stderr, "can't open %s\n", fileName);
-		return;
-	}
+	while (height / blockRows >= 32767)
+		blockRows *= 2;
+
+	return blockRows;
+}
 
-	//error handler
-	info.err = jpeg_std_error(&err); 
+//Number of gather blocks in the interval of a rank
+int getBlockCount(int rank, int P, unsigned long height) {
+	unsigned long start, end;
+	unsigned long blockRows = getBlockRows(height);
 
-  	//init jpeg decompress object
-	jpeg_create_decompress(&info);    
+	getInterval(&start, &end, rank, P, height);
 
-	//specify data source
- 	jpeg_stdio_src(&info, input);
+	return (int)((end - start + blockRows - 1) / blockRows);
+}
 
- 	//read the header    
-  	jpeg_read_header(&info, TRUE);
+//Allocate size bytes of node shared memory on this rank and return the
+//memory of rank owner of the node; the window stays open for the whole run
+unsigned char *allocateShared(unsigned long size, int owner, MPI_Win *win) {
+	unsigned char *base;
+	MPI_Aint ownerSize;
+	int dispUnit;
 
-  	// start decompression
-  	jpeg_start_decompress(&info);
+	if (MPI_Win_allocate_shared((MPI_Aint)size, 1, MPI_INFO_NULL, nodeComm, &base, win) != MPI_SUCCESS)
+		return NULL;
 
-	//get width and height
-	img->width = info.output_width;
-	img->height = info.output_height;
-	unsigned long data_size = (unsigned long)img->width * img->height * 3;
-    unsigned char* rowptr[1];
-    unsigned char* jdata;
+	MPI_Win_shared_query(*win, owner, &ownerSize, &dispUnit, &base);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
 
-	printf("Input image width and height: %lu %lu\n", (*img).width, (*img).height);
+	return base;
+}
 
-	img->data = (unsigned char *)malloc(data_size * sizeof(unsigned char));
 
-	while (info.output_scanline < info.output_height)
+// Blocks of this rank while the threads filter them
+struct progress
+{
+	unsigned char *outStrip;
+	unsigned long start;
+	unsigned long end;
+	unsigned long rowSize;
+	unsigned long blockRows;
+	int count;
+	int *done;			// filtered chunks of every block
+	int sent;			// blocks handed on so far, only used by the master thread
+	MPI_Datatype rowType;
+	MPI_Request *sends;
+	struct jpegWriter *writer;
+};
+
+//Hand on the finished blocks in order, from the master thread only: rank 0
+//encodes its own blocks, the other ranks send them to rank 0
+void passBlocks(struct progress *p, int rank) {
+	while (p->sent < p->count)
 	{
-	    rowptr[0] = (unsigned char *)img->data 
-	    			+ 3 * info.output_width * info.output_scanline; 
+		int block = p->sent;
+		unsigned long first = p->start + block * p->blockRows;
+		unsigned long last = first + p->blockRows < p->end ? first + p->blockRows : p->end;
+		int chunks = (int)((last - first + CHUNK_ROWS - 1) / CHUNK_ROWS);
+		unsigned char *rows = p->outStrip + (first - p->start) * p->rowSize;
+
+		if (__atomic_load_n(&p->done[block], __ATOMIC_ACQUIRE) < chunks)
+			return;
+
+		if (rank == 0)
+		{
+			writeRows(p->writer, rows, last - first);
+		}
+		else if (nearRoot)
+		{
+			// rank 0 reads the rows from outWin
+			MPI_Win_sync(outWin);
+			MPI_Isend(NULL, 0, p->rowType, 0, block, MPI_COMM_WORLD, &p->sends[block]);
+		}
+		else
+		{
+			MPI_Isend(rows, (int)(last - first), p->rowType, 0, block, MPI_COMM_WORLD, &p->sends[block]);
+		}
 
-	    jpeg_read_scanlines(&info, rowptr, 1);
+		p->sent++;
 	}
+}
+
+//Loop of the master thread while the others filter: hand on every block as
+//soon as it is complete and keep MPI progressing the sends and receives
+void driveBlocks(struct progress *p, int rank) {
+	while (p->sent < p->count)
+	{
+		int sent = p->sent;
+		int flag;
 
-	//finish decompression
-  	jpeg_finish_decompress(&info);
+		passBlocks(p, rank);
 
-  	//release object
-  	jpeg_destroy_decompress(&info);
+		if (rank == 0)
+			MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+		else
+			MPI_Testall(p->sent, p->sends, &flag, MPI_STATUSES_IGNORE);
 
-   	fclose(input);
+		if (p->sent == sent)
+			sched_yield();
+	}
 }
 
-
-void writeData(const char *fileName, image *img)
+//Apply filter on the rows of this rank
+//strip and outStrip point to the first row of the interval
+//The threads filter chunks of CHUNK_ROWS rows in order while the master
+//thread encodes (rank 0) or sends (other ranks) every block that is
+//complete, so the gather overlaps the filtering; a single thread does both,
+//between its chunks
+void applyFilter(unsigned char *strip, unsigned char *outStrip, image *in, int rank, int P,
+				 MPI_Datatype rowType, MPI_Request *sends, struct jpegWriter *writer)
 {
-	FILE *out;
-  	JSAMPROW row_pointer[1];
-  	int row_stride;
-	struct jpeg_compress_struct info;
-	struct jpeg_error_mgr jerr; 
-
-	if ((out = fopen(fileName, "wb")) == NULL)
+	struct progress p;
+	unsigned long nextChunk = 0;
+	unsigned long chunks;
+
+	getInterval(&p.start, &p.end, rank, P, in->height);
+	p.outStrip = outStrip;
+	p.rowSize = imageComponents * in->width;
+	p.blockRows = getBlockRows(in->height);
+	p.count = getBlockCount(rank, P, in->height);
+	p.done = (int *) calloc(p.count + 1, sizeof(int));
+	p.sent = 0;
+	p.rowType = rowType;
+	p.sends = sends;
+	p.writer = writer;
+	if (p.done == NULL)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+
+	chunks = (p.end - p.start + CHUNK_ROWS - 1) / CHUNK_ROWS;
+
+	#pragma omp parallel
 	{
-	    fprintf(stderr, "can't open %s\n", fileName);
-	    exit(1);
+		int master = omp_get_thread_num() == 0;
+		int alone = omp_get_num_threads() == 1;
+		unsigned long chunk;
+
+		if (overlap && master && !alone)
+		{
+			driveBlocks(&p, rank);
+		}
+		else
+		{
+			// a chunk is contiguous, so the row kernels can carry state
+			// (e.g. the boxsum column sums) from one row to the next
+			while ((chunk = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_RELAXED)) < chunks)
+			{
+				unsigned long from = p.start + chunk * CHUNK_ROWS;
+				unsigned long to = from + CHUNK_ROWS < p.end ? from + CHUNK_ROWS : p.end;
+
+				filterRows(strip + (from - p.start) * p.rowSize, outStrip + (from - p.start) * p.rowSize,
+						   in->width, in->height, imageComponents, from, to);
+				__atomic_add_fetch(&p.done[(from - p.start) / p.blockRows], 1, __ATOMIC_RELEASE);
+
+				if (overlap && alone)
+					passBlocks(&p, rank);
+			}
+		}
 	}
 
-  	//init jpeg decompress object
-	jpeg_create_compress(&info);
+	// every block left, without MPI_THREAD_FUNNELED
+	passBlocks(&p, rank);
 
-	//specify data dest
- 	jpeg_stdio_dest(&info, out);
+	free(p.done);
+}
 
-	//set width and height
-	info.image_width = img->width;
-	info.image_height = img->height;
-	info.input_components = 3;
-    info.in_color_space = JCS_RGB;
-    info.err = jpeg_std_error(&jerr); 
-	
-  	unsigned char* rowptr[1];
 
-	printf("Output image width and height: %lu %lu\n", (*img).width, (*img).height);
+//Post the receive of gather block k into its ring slot
+void postBlock(struct gather *g, int k, MPI_Datatype rowType) {
+	int slot = k % GATHER_WINDOW;
 
-    jpeg_set_defaults(&info);
+	if (g->shared[k] != NULL)
+	{
+		MPI_Irecv(NULL, 0, rowType, g->proc[k], g->tag[k], MPI_COMM_WORLD, &g->requests[slot]);
+		return;
+	}
 
-    jpeg_start_compress(&info, TRUE);
-	
-	while (info.next_scanline < info.image_height)
+	MPI_Irecv(g->ring + slot * g->slotSize, (int)(g->last[k] - g->first[k]), rowType,
+			  g->proc[k], g->tag[k], MPI_COMM_WORLD, &g->requests[slot]);
+}
+
+//Post the first receives, before rank 0 starts filtering
+//Returns 0 on success and -1 if the buffers can't be allocated
+int postReceives(struct gather *g, image *out, int P, MPI_Datatype rowType) {
+	unsigned long start, end;
+	unsigned long blockRows = getBlockRows(out->height);
+	int count = 0;
+
+	for (int proc = 1; proc < P; proc++)
+		count += getBlockCount(proc, P, out->height);
+
+	g->count = count;
+	g->proc = (int *) malloc((count + 1) * sizeof(int));
+	g->tag = (int *) malloc((count + 1) * sizeof(int));
+	g->first = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+	g->last = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+	g->shared = (unsigned char **) malloc((count + 1) * sizeof(unsigned char *));
+	g->slotSize = blockRows * imageComponents * out->width;
+	g->ring = (unsigned char *) malloc(GATHER_WINDOW * g->slotSize * sizeof(unsigned char));
+	if (g->proc == NULL || g->tag == NULL || g->first == NULL || g->last == NULL || g->shared == NULL || g->ring == NULL)
+		return -1;
+
+	// node ranks of every rank, MPI_UNDEFINED for the other nodes
+	MPI_Group worldGroup, nodeGroup;
+	int *procs = (int *) malloc(P * sizeof(int));
+	int *nodeRanks = (int *) malloc(P * sizeof(int));
+
+	if (procs == NULL || nodeRanks == NULL)
+		return -1;
+	for (int proc = 0; proc < P; proc++)
+		procs[proc] = proc;
+	MPI_Comm_group(MPI_COMM_WORLD, &worldGroup);
+	MPI_Comm_group(nodeComm, &nodeGroup);
+	MPI_Group_translate_ranks(worldGroup, P, procs, nodeGroup, nodeRanks);
+	MPI_Group_free(&worldGroup);
+	MPI_Group_free(&nodeGroup);
+
+	count = 0;
+	for (int proc = 1; proc < P; proc++)
 	{
-	    rowptr[0] = (unsigned char *)img->data
-		            + 3 * info.image_width * info.next_scanline; 
+		unsigned char *strip = NULL;
+		MPI_Aint size;
+		int dispUnit;
 
-	    jpeg_write_scanlines(&info, rowptr, 1);
+		getInterval(&start, &end, proc, P, out->height);
+		if (nodeRanks[proc] != MPI_UNDEFINED)
+			MPI_Win_shared_query(outWin, nodeRanks[proc], &size, &dispUnit, &strip);
+
+		for (unsigned long first = start, block = 0; first < end; first += blockRows, block++)
+		{
+			g->proc[count] = proc;
+			g->tag[count] = (int)block;
+			g->first[count] = first;
+			g->last[count] = first + blockRows < end ? first + blockRows : end;
+			g->shared[count] = strip != NULL ? strip + (first - start) * imageComponents * out->width : NULL;
+			count++;
+		}
 	}
 
-	jpeg_finish_compress(&info);
+	free(procs);
+	free(nodeRanks);
 
-	fclose(out);
+	for (int k = 0; k < g->count && k < GATHER_WINDOW; k++)
+		postBlock(g, k, rowType);
 
-	jpeg_destroy_compress(&info);
+	return 0;
 }
 
-//Compute sum of neighbours product
-int computeSum(unsigned long row, unsigned long column, image *in)
-{
-	int sum = 0;
-	unsigned long rowIdx = row - 1;
-	unsigned long colIdx = column - 3;
 
-	for (unsigned long i = rowIdx, fi = 0; i < rowIdx + 3; i++, fi++)
+//Compute the whole image; rows are encoded as soon as the blocks before
+//them have arrived
+//rank 0 already encoded its own strip while filtering it
+void computeImage(struct gather *g, MPI_Datatype rowType, struct jpegWriter *writer) {
+	for (int k = 0; k < g->count; k++)
 	{
-		for (unsigned long j = colIdx, fj = 0; j < colIdx + 9; j += 3, fj++)
+		int slot = k % GATHER_WINDOW;
+
+		MPI_Wait(&g->requests[slot], MPI_STATUS_IGNORE);
+		if (g->shared[k] != NULL)
+		{
+			MPI_Win_sync(outWin);
+			writeRows(writer, g->shared[k], g->last[k] - g->first[k]);
+		}
+		else
 		{
-			sum += (int)(in->data[i * 3 * in->width + j]) * edgeDetectionFilter[fi][fj];
+			writeRows(writer, g->ring + slot * g->slotSize, g->last[k] - g->first[k]);
 		}
+
+		// the slot is free again, reuse it for a later block
+		if (k + GATHER_WINDOW < g->count)
+			postBlock(g, k + GATHER_WINDOW, rowType);
 	}
 
-	return sum;
+	free(g->proc);
+	free(g->tag);
+	free(g->first);
+	free(g->last);
+	free(g->shared);
+	free(g->ring);
 }
 
-//Apply filter
-void applyFilter(image *in, image *out, int rank, int P)
-{
-	unsigned long start, end, j;
+//Filter one image of a batch with all the threads of this rank
+//Returns 0 on success and -1 on error
+int filterLarge(const char *inName, const char *outName) {
+	unsigned long width, height;
+	struct jpegWriter writer;
+	int result = -1;
 
-	getInterval(&start, &end, rank, P, in->height);
+	if (readSize(inName, &width, &height) != 0)
+		return -1;
 
-	// no need to make i private; it is already private
-	#pragma omp parallel for private (j)
-	for (unsigned long i = start; i < end; i++)
+	unsigned long rowSize = imageComponents * width;
+	unsigned char *in = allocImage(height * rowSize);
+	unsigned char *out = allocImage(height * rowSize);
+
+	if (in == NULL || out == NULL)
 	{
-		for (j = 0; j < 3 * in->width; j++)
+		freeImage(in);
+		freeImage(out);
+		return -1;
+	}
+
+	// every thread faults in the rows it filters
+	#pragma omp parallel
+	{
+		int thread = omp_get_thread_num();
+		int threads = omp_get_num_threads();
+		unsigned long from = thread * height / threads;
+		unsigned long to = (thread + 1) * height / threads;
+
+		touchPages(in + from * rowSize, (to - from) * rowSize);
+		touchPages(out + from * rowSize, (to - from) * rowSize);
+	}
+
+	if (readRows(inName, 0, height, in) == 0 &&
+		openWriter(&writer, outName, width, height) == 0)
+	{
+		#pragma omp parallel
 		{
-			//Border case
-			if (i < 1 || (rank == P-1 && i >= end - 1) ||
-				j < 3 || j >= 3 * in->width - 3)
-			{
-				out->data[i *  3 * in->width + j] = in->data[i * 3 * in->width + j];
-				continue;
-			}
+			int thread = omp_get_thread_num();
+			int threads = omp_get_num_threads();
+			unsigned long from = thread * height / threads;
+			unsigned long to = (thread + 1) * height / threads;
 
-			out->data[i * 3 * in->width + j] = (unsigned char)(computeSum(i, j, in) / 16);
+			filterRows(in + from * rowSize, out + from * rowSize, width, height, imageComponents, from, to);
 		}
+
+		writeRows(&writer, out, height);
+		closeWriter(&writer);
+		result = 0;
 	}
+
+	freeImage(in);
+	freeImage(out);
+
+	return result;
 }
 
+//Batch mode: rank r takes every P-th image of the batch; its threads filter
+//the small ones several at once, one image each, and the large ones one at
+//a time all together
+//Returns the number of images that failed, on rank 0
+int runBatch(int rank, int P, const char *source, const char *outDir) {
+	struct batch b;
+	int failed = 0;
+	int total = 0;
+
+	// every rank lists the batch, rank 0 reads the image sizes
+	if (readBatch(source, outDir, &b) != 0)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	if (rank == 0 && classifyBatch(&b) != 0)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	if (rank != 0 && (b.large = (char *) calloc(b.count + 1, sizeof(char))) == NULL)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	MPI_Bcast(b.large, b.count, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+	printSizes = 0;
+	MPI_Barrier(MPI_COMM_WORLD);
+	double begin = MPI_Wtime();
 
-//Compute the whole image
-void computeImage(image *out, int rank, int P) {
-	unsigned long start, end;
-	
-	if (rank != 0) 
+	#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+	for (int k = rank; k < b.count; k += P)
 	{
-		getInterval(&start, &end, rank, P, out->height);
-    		printf("%d: %ld %ld\n", rank, start * 3 * out->width, (end - start) * 3 * out->width);
-		MPI_Send(out->data + start * 3 * out->width, (end - start) * 3 * out->width, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-	} 
-	else 
+		if (!b.large[k] && filterImage(b.inputs[k], b.outputs[k]) != 0)
+		{
+			fprintf(stderr, "%d: can't filter %s\n", rank, b.inputs[k]);
+			failed++;
+		}
+	}
+
+	for (int k = rank; k < b.count; k += P)
 	{
-		for (int proc = 1; proc < P; proc++) 
+		if (b.large[k] && filterLarge(b.inputs[k], b.outputs[k]) != 0)
 		{
-			getInterval(&start, &end, proc, P, out->height);
-	    		MPI_Recv(out->data + start * 3 * out->width, (end - start) * 3 * out->width, MPI_UNSIGNED_CHAR, proc, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			fprintf(stderr, "%d: can't filter %s\n", rank, b.inputs[k]);
+			failed++;
 		}
 	}
+
+	MPI_Reduce(&failed, &total, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (rank == 0)
+		reportBatch(b.count - total, total, MPI_Wtime() - begin);
+
+	freeBatch(&b);
+
+	return total;
 }
 
 int main(int argc, char * argv[]) {
@@ -210,66 +469,253 @@ int main(int argc, char * argv[]) {
 	int rank;
 	int P;
 
-	MPI_Init(&argc, &argv);
+	int provided;
+
+	// Only the master thread of the OpenMP regions calls MPI
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &P);
 
-	if (rank == 0) 
+	if (provided < MPI_THREAD_FUNNELED)
 	{
-		// Read the input image
-		readInput(argv[1], &in);
+		if (rank == 0)
+			printf("MPI_THREAD_FUNNELED is not supported, got level %d; no overlap\n", provided);
+		overlap = 0;
 	}
 
-    	MPI_Bcast(&in.width, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
-    	MPI_Bcast(&in.height, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
-    	
-	if (rank != 0)
-       	{
-    		unsigned long data_size = in.width * in.height * 3;
-        	in.data = (unsigned char *) malloc(data_size * sizeof(unsigned char));
-   	}
+	int opt;
+	int distributed = 0;
+	int batchMode = 0;
 
-    	MPI_Bcast(in.data, in.width * in.height, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
-	MPI_Barrier(MPI_COMM_WORLD);
-	printf("chunk 1\n");
-    	MPI_Bcast(in.data + in.width * in.height, in.width * in.height, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
-	MPI_Barrier(MPI_COMM_WORLD);
-	printf("chunk 2\n");
-    	MPI_Bcast(in.data + 2 * in.width * in.height, in.width * in.height, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
-	printf("chunk 3\n");
-	MPI_Barrier(MPI_COMM_WORLD);
+	while ((opt = getopt(argc, argv, "m:k:dbg")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			if (setFilterMode(optarg) != 0)
+			{
+				fprintf(stderr, "unknown filter mode %s\n", optarg);
+				MPI_Finalize();
+				return -1;
+			}
+			break;
+		case 'k':
+			if (setFilterKernel(optarg) != 0)
+			{
+				MPI_Finalize();
+				return -1;
+			}
+			break;
+		case 'd':
+			distributed = 1;
+			break;
+		case 'g':
+			imageComponents = 1;
+			break;
+		case 'b':
+			batchMode = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-d] [-b] [-g] <image_in|batch> <image_out|dir>\n", argv[0]);
+			MPI_Finalize();
+			return -1;
+		}
+	}
+
+	if (argc - optind < 2)
+	{
+		fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-d] [-b] [-g] <image_in|batch> <image_out|dir>\n", argv[0]);
+		MPI_Finalize();
+		return -1;
+	}
+
+	// Batch mode, <image_in> is a manifest or directory and <image_out> the
+	// output directory
+	halo = filterRadius();
+
+	if (batchMode)
+	{
+		int failed = runBatch(rank, P, argv[optind], argv[optind + 1]);
+
+		MPI_Finalize();
+
+		return failed == 0 ? 0 : -1;
+	}
+
+	// Every rank decodes its own rows only if they can be reached without
+	// decoding the ones before them
+	if (distributed && !canSkipRows())
+	{
+		if (rank == 0)
+			printf("libjpeg can't skip rows, decoding on rank 0\n");
+		distributed = 0;
+	}
+
+	in.data = NULL;
+
+	int nodeRank;
+	int rootRank = 0;
+	int rootNodeRank;
+	MPI_Group worldGroup, nodeGroup;
+
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+	MPI_Comm_rank(nodeComm, &nodeRank);
+
+	MPI_Comm_group(MPI_COMM_WORLD, &worldGroup);
+	MPI_Comm_group(nodeComm, &nodeGroup);
+	MPI_Group_translate_ranks(worldGroup, 1, &rootRank, nodeGroup, &rootNodeRank);
+	MPI_Group_free(&worldGroup);
+	MPI_Group_free(&nodeGroup);
+	nearRoot = rootNodeRank != MPI_UNDEFINED;
+
+	if (distributed)
+	{
+		if (readSize(argv[optind], &in.width, &in.height) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	else
+	{
+		if (rank == 0 && readSize(argv[optind], &in.width, &in.height) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+
+		MPI_Bcast(&in.width, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&in.height, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	}
+
+	if (rank == 0)
+		printf("Input image width and height: %lu %lu\n", in.width, in.height);
+
+	unsigned long start, end;
+	unsigned long rowSize = imageComponents * in.width;
+	unsigned char *stripBuffer = NULL;
+	unsigned char *strip;
+
+	MPI_Datatype rowType;
+	MPI_Type_contiguous((int)rowSize, MPI_UNSIGNED_CHAR, &rowType);
+	MPI_Type_commit(&rowType);
+
+	getInterval(&start, &end, rank, P, in.height);
+
+	if (distributed)
+	{
+		// Decode the strip and its halo rows straight from the file
+		unsigned long first = start >= halo ? start - halo : 0;
+		unsigned long last = end + halo <= in.height ? end + halo : in.height;
+
+		stripBuffer = allocImage((end - start + 2 * halo) * rowSize);
+		if (stripBuffer == NULL)
+		{
+			fprintf(stderr, "%d: can't allocate the strip\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		strip = stripBuffer + halo * rowSize;
+
+		if (start < end && readRows(argv[optind], first, last, strip - (start - first) * rowSize) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	else
+	{
+		// One copy of the image per node, owned by the first rank of the node
+		MPI_Comm leaderComm;
+
+		in.data = allocateShared(nodeRank == 0 ? in.height * rowSize : 0, 0, &inWin);
+		if (in.data == NULL)
+		{
+			fprintf(stderr, "%d: can't allocate the input\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+
+		if (rank == 0 && readRows(argv[optind], 0, in.height, in.data) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+
+		// Only the first ranks of the nodes take part in the broadcast
+		MPI_Comm_split(MPI_COMM_WORLD, nodeRank == 0 ? 0 : MPI_UNDEFINED, rank, &leaderComm);
+		if (leaderComm != MPI_COMM_NULL)
+		{
+			if (bigBcast(in.data, in.height * rowSize, 0, leaderComm) != MPI_SUCCESS)
+				MPI_Abort(MPI_COMM_WORLD, 1);
+			MPI_Comm_free(&leaderComm);
+		}
+
+		MPI_Win_sync(inWin);
+		MPI_Barrier(nodeComm);
+		MPI_Win_sync(inWin);
+
+		strip = in.data + start * rowSize;
+	}
 
 	if (rank == 0)
 		printf("successfully read input\n");
-	
+
+	// Every rank holds only the output of its own strip, in the node window
+	unsigned char *outStrip;
+
 	out.height = in.height;
 	out.width = in.width;
-	unsigned long data_size = (unsigned long)out.width * out.height * 3;
-	out.data = (unsigned char *) malloc(data_size * sizeof(unsigned char));
+	outStrip = allocateShared((end - start) * rowSize, nodeRank, &outWin);
+	if (outStrip == NULL && start < end)
+	{
+		fprintf(stderr, "%d: can't allocate the output\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
 
 	if (rank == 0)
 		printf("successfully Initialized output\n");
 
+	// Post the receives first, so the other strips arrive while rank 0
+	// filters and encodes its own rows
+	MPI_Request *requests = NULL;
+	struct gather gather;
+	struct jpegWriter writer;
+
+	if (rank == 0)
+	{
+		if (postReceives(&gather, &out, P, rowType) != 0 ||
+			openWriter(&writer, argv[optind + 1], out.width, out.height) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	else
+	{
+		requests = (MPI_Request *) malloc((getBlockCount(rank, P, in.height) + 1) * sizeof(MPI_Request));
+		if (requests == NULL)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
 	// Apply the filter on image on chunks
-	applyFilter(&in, &out, rank, P);
-	MPI_Barrier(MPI_COMM_WORLD);
+	applyFilter(strip, outStrip, &in, rank, P, rowType, requests, &writer);
 
 	if (rank == 0)
 		printf("successfully applied filter\n");
 
 	// Compute the whole image
-	computeImage(&out, rank, P);
-
 	if (rank == 0)
-		writeData(argv[2], &out);
+	{
+		computeImage(&gather, rowType, &writer);
+		closeWriter(&writer);
+	}
+	else
+	{
+		MPI_Waitall(getBlockCount(rank, P, in.height), requests, MPI_STATUSES_IGNORE);
+	}
+
+	free(requests);
+	MPI_Type_free(&rowType);
+
+	if (inWin != MPI_WIN_NULL)
+	{
+		MPI_Win_unlock_all(inWin);
+		MPI_Win_free(&inWin);
+	}
+	MPI_Win_unlock_all(outWin);
+	MPI_Win_free(&outWin);
+	MPI_Comm_free(&nodeComm);
 
 	MPI_Finalize();
 
 	if (rank == 0)
 		printf("successfully wrote data \n");
 
-	free(in.data);
-	free(out.data);
+	freeImage(stripBuffer);
 
 	return 0;
 }
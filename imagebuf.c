@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "imagebuf.h"
+
+// Alignment of the data, and room for the block header in front of it
+#define IMAGE_ALIGN 64
+
+// Smaller buffers come from malloc
+#define MAP_MIN (1UL << 20)
+
+// Mapped blocks are a whole number of huge pages, as MAP_HUGETLB needs
+#define HUGE_PAGE (2UL << 20)
+
+// Freed blocks kept for reuse, and the bytes they may hold together; the
+// oldest blocks are unmapped to stay under it
+#define POOL_BLOCKS 32
+#define POOL_BYTES (1UL << 30)
+
+struct blockHeader
+{
+	unsigned long length;
+	int mapped;
+};
+
+struct pooledBlock
+{
+	unsigned char *block;
+	unsigned long length;
+};
+
+static struct pooledBlock pool[POOL_BLOCKS];
+static int pooled = 0;			// oldest first
+static unsigned long pooledBytes = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Take the smallest pooled block of at least length bytes, unless it is more
+//than twice as large as needed; *length becomes its real length
+static unsigned char *takePooled(unsigned long *length)
+{
+	unsigned char *block = NULL;
+	int best = -1;
+
+	pthread_mutex_lock(&poolLock);
+	for (int k = 0; k < pooled; k++)
+	{
+		if (pool[k].length >= *length && pool[k].length <= 2 * *length &&
+			(best < 0 || pool[k].length < pool[best].length))
+			best = k;
+	}
+	if (best >= 0)
+	{
+		block = pool[best].block;
+		*length = pool[best].length;
+		pooledBytes -= pool[best].length;
+		memmove(&pool[best], &pool[best + 1], (--pooled - best) * sizeof(struct pooledBlock));
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	return block;
+}
+
+static unsigned char *mapBlock(unsigned long length)
+{
+	void *block;
+
+#ifdef MAP_HUGETLB
+	// reserved huge pages, if the administrator set any aside
+	block = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (block != MAP_FAILED)
+		return (unsigned char *)block;
+#endif
+
+	block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	// otherwise ask for transparent huge pages
+	madvise(block, length, MADV_HUGEPAGE);
+#endif
+
+	return (unsigned char *)block;
+}
+
+unsigned char *allocImage(unsigned long size)
+{
+	unsigned long length = size + IMAGE_ALIGN;
+	unsigned char *block;
+	int mapped = length >= MAP_MIN;
+
+	if (mapped)
+	{
+		length = (length + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+		// a pooled block keeps its pages on the NUMA nodes of whoever
+		// faulted them in first; touchPages on it doesn't move them, so the
+		// new image only gets first touch placement on a fresh mapping
+		block = takePooled(&length);
+		if (block == NULL)
+			block = mapBlock(length);
+	}
+	else if (posix_memalign((void **)&block, IMAGE_ALIGN, length) != 0)
+	{
+		block = NULL;
+	}
+
+	if (block == NULL)
+		return NULL;
+
+	((struct blockHeader *)block)->length = length;
+	((struct blockHeader *)block)->mapped = mapped;
+
+	return block + IMAGE_ALIGN;
+}
+
+void freeImage(unsigned char *buffer)
+{
+	if (buffer == NULL)
+		return;
+
+	unsigned char *block = buffer - IMAGE_ALIGN;
+	struct blockHeader *header = (struct blockHeader *)block;
+
+	if (!header->mapped)
+	{
+		free(block);
+		return;
+	}
+
+	unsigned long length = header->length;
+	struct pooledBlock evicted[POOL_BLOCKS];
+	int count = 0;
+
+	pthread_mutex_lock(&poolLock);
+	if (length <= POOL_BYTES)
+	{
+		while (pooled > 0 && (pooled == POOL_BLOCKS || pooledBytes + length > POOL_BYTES))
+		{
+			evicted[count++] = pool[0];
+			pooledBytes -= pool[0].length;
+			memmove(&pool[0], &pool[1], --pooled * sizeof(struct pooledBlock));
+		}
+		pool[pooled].block = block;
+		pool[pooled++].length = length;
+		pooledBytes += length;
+		block = NULL;
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	if (block != NULL)
+		munmap(block, length);
+	for (int k = 0; k < count; k++)
+		munmap(evicted[k].block, evicted[k].length);
+}
+
+void touchPages(unsigned char *start, unsigned long size)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+
+	for (unsigned long k = 0; k < size; k += pageSize)
+		start[k] = 0;
+	if (size > 0)
+		start[size - 1] = 0;
+}
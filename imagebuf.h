@@ -0,0 +1,19 @@
+#ifndef IMAGEBUF_H
+#define IMAGEBUF_H
+
+//Allocate size bytes of image data, 64 byte aligned
+//Buffers of a megabyte or more are mapped, with huge pages when the system
+//has them, and go back to a pool of at most a gigabyte on freeImage so the
+//next image of about the same size reuses them without page faults
+//Returns NULL if there is not enough memory
+unsigned char *allocImage(unsigned long size);
+
+//Give back a buffer of allocImage; NULL is ignored
+void freeImage(unsigned char *buffer);
+
+//Write to every page of [start, start + size), so they are faulted in by
+//the calling thread (and on NUMA systems placed on its node); pages of a
+//reused pool block are already in place and stay where they are
+void touchPages(unsigned char *start, unsigned long size);
+
+#endif
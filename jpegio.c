@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include "jpegio.h"
+
+int printSizes = 1;
+int imageComponents = 3;
+
+J_COLOR_SPACE imageColorSpace(void)
+{
+	return imageComponents == 1 ? JCS_GRAYSCALE : JCS_RGB;
+}
+
+int openWriter(struct jpegWriter *writer, const char *fileName,
+			   unsigned long width, unsigned long height)
+{
+	if ((writer->file = fopen(fileName, "wb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", fileName);
+		return -1;
+	}
+
+	writer->info.err = jpeg_std_error(&writer->err);
+	jpeg_create_compress(&writer->info);
+	jpeg_stdio_dest(&writer->info, writer->file);
+
+	writer->info.image_width = width;
+	writer->info.image_height = height;
+	writer->info.input_components = imageComponents;
+	writer->info.in_color_space = imageColorSpace();
+
+	if (printSizes)
+		printf("Output image width and height: %lu %lu\n", width, height);
+
+	jpeg_set_defaults(&writer->info);
+	jpeg_start_compress(&writer->info, TRUE);
+
+	return 0;
+}
+
+void writeRows(struct jpegWriter *writer, unsigned char *rows, unsigned long count)
+{
+	unsigned long rowSize = imageComponents * (unsigned long)writer->info.image_width;
+	unsigned char *rowptr[1];
+
+	for (unsigned long i = 0; i < count; i++)
+	{
+		rowptr[0] = rows + i * rowSize;
+		jpeg_write_scanlines(&writer->info, rowptr, 1);
+	}
+}
+
+void closeWriter(struct jpegWriter *writer)
+{
+	jpeg_finish_compress(&writer->info);
+	fclose(writer->file);
+	jpeg_destroy_compress(&writer->info);
+}
+
+//Settings shared by every band, so all of them use the same tables
+static void setBandDefaults(struct jpeg_compress_struct *info,
+							unsigned long width, unsigned long height)
+{
+	info->image_width = width;
+	info->image_height = height;
+	info->input_components = imageComponents;
+	info->in_color_space = imageColorSpace();
+
+	jpeg_set_defaults(info);
+	info->restart_in_rows = 1;
+}
+
+unsigned long getBandAlign(void)
+{
+	struct jpeg_compress_struct info;
+	struct jpeg_error_mgr err;
+	int maxSamp = 1;
+
+	info.err = jpeg_std_error(&err);
+	jpeg_create_compress(&info);
+	setBandDefaults(&info, 1, 1);
+
+	for (int c = 0; c < info.num_components; c++)
+		if (info.comp_info[c].v_samp_factor > maxSamp)
+			maxSamp = info.comp_info[c].v_samp_factor;
+
+	jpeg_destroy_compress(&info);
+
+	return (unsigned long)maxSamp * DCTSIZE;
+}
+
+unsigned long getBandRows(unsigned long height, int parts)
+{
+	unsigned long align = getBandAlign();
+	unsigned long rows = (height + parts - 1) / parts;
+
+	rows = (rows + align - 1) / align * align;
+
+	return rows > 0 ? rows : align;
+}
+
+void encodeBand(unsigned char *rows, unsigned long width, unsigned long count,
+				unsigned char **band, unsigned long *size)
+{
+	struct jpeg_compress_struct info;
+	struct jpeg_error_mgr err;
+	unsigned char *rowptr[1];
+
+	*band = NULL;
+	*size = 0;
+
+	info.err = jpeg_std_error(&err);
+	jpeg_create_compress(&info);
+	jpeg_mem_dest(&info, band, size);
+	setBandDefaults(&info, width, count);
+	jpeg_start_compress(&info, TRUE);
+
+	while (info.next_scanline < info.image_height)
+	{
+		rowptr[0] = rows + imageComponents * width * info.next_scanline;
+		jpeg_write_scanlines(&info, rowptr, 1);
+	}
+
+	jpeg_finish_compress(&info);
+	jpeg_destroy_compress(&info);
+}
+
+//Offset of the first byte after the SOS segment, or 0 if there is none
+static unsigned long findScanData(unsigned char *band, unsigned long size)
+{
+	unsigned long pos = 2;
+
+	while (pos + 4 <= size && band[pos] == 0xFF)
+	{
+		unsigned long length = ((unsigned long)band[pos + 2] << 8) | band[pos + 3];
+
+		if (band[pos + 1] == 0xDA)
+			return pos + 2 + length;
+		pos += 2 + length;
+	}
+
+	return 0;
+}
+
+int writeBands(const char *fileName, unsigned char **bands, unsigned long *sizes,
+			   int count, unsigned long height)
+{
+	FILE *out;
+	unsigned long header = findScanData(bands[0], sizes[0]);
+	unsigned int restarts = 0;
+
+	if (header == 0)
+	{
+		fprintf(stderr, "band 0 has no scan\n");
+		return -1;
+	}
+
+	if ((out = fopen(fileName, "wb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", fileName);
+		return -1;
+	}
+
+	// the frame header of band 0 gets the height of the whole image
+	for (unsigned long pos = 2; pos + 9 <= header; )
+	{
+		unsigned long length = ((unsigned long)bands[0][pos + 2] << 8) | bands[0][pos + 3];
+
+		if (bands[0][pos + 1] == 0xC0)
+		{
+			bands[0][pos + 5] = (height >> 8) & 0xFF;
+			bands[0][pos + 6] = height & 0xFF;
+			break;
+		}
+		pos += 2 + length;
+	}
+
+	fwrite(bands[0], 1, header, out);
+
+	for (int k = 0; k < count; k++)
+	{
+		unsigned long start = findScanData(bands[k], sizes[k]);
+		unsigned long end = sizes[k] - 2;	// drop the EOI marker
+
+		if (k > 0)
+		{
+			fputc(0xFF, out);
+			fputc(0xD0 + (restarts++ & 7), out);
+		}
+
+		// RSTn markers count on from the previous band; 0xFF inside the
+		// entropy coded data is always followed by a stuffed 0x00
+		for (unsigned long pos = start; pos + 1 < end; pos++)
+		{
+			if (bands[k][pos] == 0xFF && bands[k][pos + 1] >= 0xD0 && bands[k][pos + 1] <= 0xD7)
+				bands[k][++pos] = 0xD0 + (restarts++ & 7);
+		}
+
+		fwrite(bands[k] + start, 1, end - start, out);
+	}
+
+	fputc(0xFF, out);
+	fputc(0xD9, out);
+	fclose(out);
+
+	return 0;
+}
+
+// Error manager that returns to the caller instead of exiting, for input
+// that comes from somebody else
+struct jpegError
+{
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void errorJump(j_common_ptr info)
+{
+	struct jpegError *err = (struct jpegError *)info->err;
+
+	(*info->err->output_message)(info);
+	longjmp(err->jump, 1);
+}
+
+//Open fileName for decoding to imageComponents; errors jump to err->jump,
+//so the caller sets it before reading the header with readHeader
+static FILE *openReader(const char *fileName, struct jpeg_decompress_struct *info,
+						struct jpegError *err)
+{
+	FILE *input;
+
+	if (fileName == NULL ||
+		(input = fopen(fileName, "rb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", fileName);
+		return NULL;
+	}
+
+	info->err = jpeg_std_error(&err->mgr);
+	err->mgr.error_exit = errorJump;
+	jpeg_create_decompress(info);
+	jpeg_stdio_src(info, input);
+
+	return input;
+}
+
+static void readHeader(struct jpeg_decompress_struct *info)
+{
+	jpeg_read_header(info, TRUE);
+	info->out_color_space = imageColorSpace();
+}
+
+int readSize(const char *fileName, unsigned long *width, unsigned long *height)
+{
+	struct jpeg_decompress_struct info;
+	struct jpegError err;
+	FILE *input = openReader(fileName, &info, &err);
+
+	if (input == NULL)
+		return -1;
+
+	if (setjmp(err.jump))
+	{
+		jpeg_destroy_decompress(&info);
+		fclose(input);
+		return -1;
+	}
+
+	readHeader(&info);
+	jpeg_calc_output_dimensions(&info);
+	*width = info.output_width;
+	*height = info.output_height;
+
+	jpeg_destroy_decompress(&info);
+	fclose(input);
+
+	return 0;
+}
+
+int canSkipRows(void)
+{
+#ifdef LIBJPEG_TURBO_VERSION
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int readRows(const char *fileName, unsigned long first, unsigned long last,
+			 unsigned char *rows)
+{
+	struct jpeg_decompress_struct info;
+	struct jpegError err;
+	FILE *input = openReader(fileName, &info, &err);
+	unsigned char *volatile scratch = NULL;
+	unsigned char *rowptr[1];
+
+	if (input == NULL)
+		return -1;
+
+	if (setjmp(err.jump))
+	{
+		jpeg_destroy_decompress(&info);
+		fclose(input);
+		free(scratch);
+		return -1;
+	}
+
+	readHeader(&info);
+	jpeg_start_decompress(&info);
+
+	unsigned long rowSize = imageComponents * (unsigned long)info.output_width;
+
+#ifdef LIBJPEG_TURBO_VERSION
+	// skipped rows are entropy decoded but not transformed or converted
+	if (first > 0)
+		jpeg_skip_scanlines(&info, first);
+#else
+	// decode and drop the rows before the interval
+	if (first > 0)
+	{
+		scratch = (unsigned char *)malloc(rowSize * sizeof(unsigned char));
+		if (scratch == NULL)
+		{
+			fprintf(stderr, "can't allocate a row of %s\n", fileName);
+			jpeg_destroy_decompress(&info);
+			fclose(input);
+			return -1;
+		}
+
+		while (info.output_scanline < first)
+		{
+			rowptr[0] = scratch;
+			jpeg_read_scanlines(&info, rowptr, 1);
+		}
+		free(scratch);
+		scratch = NULL;
+	}
+#endif
+
+	while (info.output_scanline < last)
+	{
+		rowptr[0] = rows + (info.output_scanline - first) * rowSize;
+		jpeg_read_scanlines(&info, rowptr, 1);
+	}
+
+	// the rows after the interval are not needed
+	jpeg_abort_decompress(&info);
+	jpeg_destroy_decompress(&info);
+	fclose(input);
+
+	return 0;
+}
+
+int decodeMemory(const unsigned char *data, unsigned long size, unsigned char **pixels,
+				 unsigned long *capacity, unsigned long *width, unsigned long *height)
+{
+	struct jpeg_decompress_struct info;
+	struct jpegError err;
+	unsigned char *rowptr[1];
+
+	info.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = errorJump;
+	if (setjmp(err.jump))
+	{
+		jpeg_destroy_decompress(&info);
+		return -1;
+	}
+
+	jpeg_create_decompress(&info);
+	jpeg_mem_src(&info, (unsigned char *)data, size);
+	jpeg_read_header(&info, TRUE);
+	info.out_color_space = imageColorSpace();
+	jpeg_start_decompress(&info);
+
+	unsigned long rowSize = imageComponents * (unsigned long)info.output_width;
+	unsigned long needed = rowSize * info.output_height;
+
+	// the old contents are not needed, so no realloc
+	if (needed > *capacity)
+	{
+		free(*pixels);
+		*pixels = (unsigned char *)malloc(needed * sizeof(unsigned char));
+		*capacity = *pixels != NULL ? needed : 0;
+		if (*pixels == NULL)
+		{
+			jpeg_destroy_decompress(&info);
+			return -1;
+		}
+	}
+
+	while (info.output_scanline < info.output_height)
+	{
+		rowptr[0] = *pixels + info.output_scanline * rowSize;
+		jpeg_read_scanlines(&info, rowptr, 1);
+	}
+
+	*width = info.output_width;
+	*height = info.output_height;
+
+	jpeg_finish_decompress(&info);
+	jpeg_destroy_decompress(&info);
+
+	return 0;
+}
+
+int encodeMemory(unsigned char *pixels, unsigned long width, unsigned long height,
+				 unsigned char **jpeg, unsigned long *size)
+{
+	struct jpeg_compress_struct info;
+	struct jpegError err;
+	unsigned char *rowptr[1];
+
+	*jpeg = NULL;
+	*size = 0;
+
+	info.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = errorJump;
+	if (setjmp(err.jump))
+	{
+		jpeg_destroy_compress(&info);
+		free(*jpeg);
+		*jpeg = NULL;
+		return -1;
+	}
+
+	jpeg_create_compress(&info);
+	jpeg_mem_dest(&info, jpeg, size);
+
+	info.image_width = width;
+	info.image_height = height;
+	info.input_components = imageComponents;
+	info.in_color_space = imageColorSpace();
+
+	jpeg_set_defaults(&info);
+	jpeg_start_compress(&info, TRUE);
+
+	while (info.next_scanline < info.image_height)
+	{
+		rowptr[0] = pixels + info.next_scanline * imageComponents * width;
+		jpeg_write_scanlines(&info, rowptr, 1);
+	}
+
+	jpeg_finish_compress(&info);
+	jpeg_destroy_compress(&info);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef JPEGIO_H
+#define JPEGIO_H
+
+#include <stdio.h>
+#include <jpeglib.h>
+
+// Print the size of every image openWriter creates; batch runs turn it off
+extern int printSizes;
+
+// Color components of every image decoded and encoded here: 3 for RGB, 1 to
+// decode straight to luminance and write grayscale JPEGs, which also skips
+// the color conversion and the chroma upsampling
+extern int imageComponents;
+
+//Color space of imageComponents
+J_COLOR_SPACE imageColorSpace(void);
+
+// JPEG encoder that takes the image a few rows at a time
+struct jpegWriter
+{
+	FILE *file;
+	struct jpeg_compress_struct info;
+	struct jpeg_error_mgr err;
+};
+
+//Create fileName and start compressing a width x height image
+//Returns 0 on success and -1 if the file can't be opened
+int openWriter(struct jpegWriter *writer, const char *fileName,
+			   unsigned long width, unsigned long height);
+
+//Compress the next count rows, stored one after another
+void writeRows(struct jpegWriter *writer, unsigned char *rows, unsigned long count);
+
+//Finish the image and close the file
+void closeWriter(struct jpegWriter *writer);
+
+//Rows of one MCU row; bands must start on a multiple of it
+unsigned long getBandAlign(void);
+
+//Rows per band to split an image of the given height in about parts bands
+unsigned long getBandRows(unsigned long height, int parts);
+
+//Compress count rows as one band of a restart-interval JPEG (one restart
+//interval per MCU row); the band is returned in a malloc'ed buffer
+void encodeBand(unsigned char *rows, unsigned long width, unsigned long count,
+				unsigned char **band, unsigned long *size);
+
+//Stitch the bands, in image order, into one baseline JPEG: the header of
+//the first band with the full height, then the entropy coded data of all
+//bands joined by renumbered RSTn markers
+//Returns 0 on success and -1 if the file can't be written
+int writeBands(const char *fileName, unsigned char **bands, unsigned long *sizes,
+			   int count, unsigned long height);
+
+//Read the size of a JPEG image without decoding it
+//Returns 0 on success and -1 if the file can't be opened or isn't a JPEG
+int readSize(const char *fileName, unsigned long *width, unsigned long *height);
+
+//Nonzero when readRows can skip the rows before its interval without
+//decoding them (libjpeg-turbo's jpeg_skip_scanlines)
+int canSkipRows(void);
+
+//Decode only the rows [first, last) of an image, one after another
+//Corrupt data is reported instead of ending the process
+//Returns 0 on success and -1 if the file can't be opened or decoded
+int readRows(const char *fileName, unsigned long first, unsigned long last,
+			 unsigned char *rows);
+
+//Decode a JPEG held in memory into *pixels, a buffer of *capacity
+//bytes that is replaced by a larger one when the image doesn't fit
+//Corrupt data is reported instead of ending the process
+//Returns 0 on success and -1 on error
+int decodeMemory(const unsigned char *data, unsigned long size, unsigned char **pixels,
+				 unsigned long *capacity, unsigned long *width, unsigned long *height);
+
+//Compress an image into a malloc'ed buffer, with the same settings as
+//openWriter
+//Returns 0 on success and -1 on error
+int encodeMemory(unsigned char *pixels, unsigned long width, unsigned long height,
+				 unsigned char **jpeg, unsigned long *size);
+
+#endif
@@ -0,0 +1,852 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include "kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+// Largest weight and divisor accepted; with |divisor| below 2^21 the double
+// division of the SIMD code truncates exactly like the integer one
+#define MAX_WEIGHT (1 << 20)
+
+struct builtin
+{
+	const char *name;
+	int size;
+	int divisor;
+	int weights[25];
+};
+
+static const struct builtin builtins[] = {
+	{"edge", 3, 16, {-1, -1, -1,
+					 -1, 8, -1,
+					 -1, -1, -1}},
+	{"sobelx", 3, 1, {-1, 0, 1,
+					  -2, 0, 2,
+					  -1, 0, 1}},
+	{"sobely", 3, 1, {-1, -2, -1,
+					  0, 0, 0,
+					  1, 2, 1}},
+	{"prewittx", 3, 1, {-1, 0, 1,
+						-1, 0, 1,
+						-1, 0, 1}},
+	{"prewitty", 3, 1, {-1, -1, -1,
+						0, 0, 0,
+						1, 1, 1}},
+	{"gauss3", 3, 16, {1, 2, 1,
+					   2, 4, 2,
+					   1, 2, 1}},
+	{"gauss5", 5, 256, {1, 4, 6, 4, 1,
+						4, 16, 24, 16, 4,
+						6, 24, 36, 24, 6,
+						4, 16, 24, 16, 4,
+						1, 4, 6, 4, 1}},
+	{"box5", 5, 25, {1, 1, 1, 1, 1,
+					 1, 1, 1, 1, 1,
+					 1, 1, 1, 1, 1,
+					 1, 1, 1, 1, 1,
+					 1, 1, 1, 1, 1}},
+	{"sharpen", 3, 1, {0, -1, 0,
+					   -1, 5, -1,
+					   0, -1, 0}},
+};
+
+//Read the next number of a kernel file, skipping # comments
+//Returns 0 on success and -1 at the end of the file or on junk
+static int readNumber(FILE *file, long *value)
+{
+	int c;
+
+	while ((c = fgetc(file)) != EOF)
+	{
+		if (c == '#')
+		{
+			while ((c = fgetc(file)) != EOF && c != '\n')
+				;
+		}
+		else if (!isspace(c))
+		{
+			ungetc(c, file);
+			return fscanf(file, "%ld", value) == 1 ? 0 : -1;
+		}
+	}
+
+	return -1;
+}
+
+static int readKernelFile(const char *fileName, struct kernel *k)
+{
+	FILE *file = fopen(fileName, "r");
+	long size, divisor, weight;
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", fileName);
+		return -1;
+	}
+
+	if (readNumber(file, &size) != 0 || readNumber(file, &divisor) != 0 ||
+		size < 1 || size > KERNEL_MAX_SIZE || size % 2 == 0 ||
+		divisor == 0 || divisor <= -MAX_WEIGHT || divisor >= MAX_WEIGHT)
+	{
+		fprintf(stderr, "%s: expected an odd side up to %d and a divisor\n", fileName, KERNEL_MAX_SIZE);
+		fclose(file);
+		return -1;
+	}
+
+	k->size = (int)size;
+	k->divisor = (int)divisor;
+	k->weights = (int *) malloc(size * size * sizeof(int));
+	if (k->weights == NULL)
+	{
+		fclose(file);
+		return -1;
+	}
+
+	for (long i = 0; i < size * size; i++)
+	{
+		if (readNumber(file, &weight) != 0 || weight <= -MAX_WEIGHT || weight >= MAX_WEIGHT)
+		{
+			fprintf(stderr, "%s: expected %ld weights\n", fileName, size * size);
+			free(k->weights);
+			fclose(file);
+			return -1;
+		}
+		k->weights[i] = (int)weight;
+	}
+
+	if (readNumber(file, &weight) == 0)
+	{
+		fprintf(stderr, "%s: more than %ld weights\n", fileName, size * size);
+		free(k->weights);
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+static int gcd(int a, int b)
+{
+	while (b != 0)
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+//Split the kernel into a column and a row factor, if it has integer ones:
+//the row is the first non zero row divided by the gcd of its weights
+static int factorKernel(struct kernel *k)
+{
+	int size = k->size;
+	int pivot = -1;
+	int g = 0;
+
+	for (int n = 0; n < size * size && pivot < 0; n++)
+		if (k->weights[n] != 0)
+			pivot = n;
+	if (pivot < 0)
+		return 0;
+
+	int pivotRow = pivot / size;
+	int pivotCol = pivot % size;
+
+	for (int j = 0; j < size; j++)
+		g = gcd(g, abs(k->weights[pivotRow * size + j]));
+
+	for (int j = 0; j < size; j++)
+		k->row[j] = k->weights[pivotRow * size + j] / g;
+
+	for (int i = 0; i < size; i++)
+	{
+		if (k->weights[i * size + pivotCol] % k->row[pivotCol] != 0)
+			return 0;
+		k->column[i] = k->weights[i * size + pivotCol] / k->row[pivotCol];
+
+		for (int j = 0; j < size; j++)
+			if (k->column[i] * k->row[j] != k->weights[i * size + j])
+				return 0;
+	}
+
+	return 1;
+}
+
+//Load one stage: a built in kernel or a kernel file
+static int loadStage(const char *spec, struct kernel *k)
+{
+	int found = 0;
+	long total = 0;
+
+	memset(k, 0, sizeof(*k));
+
+	for (unsigned long n = 0; n < sizeof(builtins) / sizeof(builtins[0]); n++)
+	{
+		if (strcmp(spec, builtins[n].name) != 0)
+			continue;
+
+		k->size = builtins[n].size;
+		k->divisor = builtins[n].divisor;
+		k->weights = (int *) malloc(k->size * k->size * sizeof(int));
+		if (k->weights == NULL)
+			return -1;
+		memcpy(k->weights, builtins[n].weights, k->size * k->size * sizeof(int));
+		found = 1;
+	}
+
+	if (!found && readKernelFile(spec, k) != 0)
+		return -1;
+
+	k->radius = k->size / 2;
+
+	// every sum has to fit in 32 bits
+	for (int n = 0; n < k->size * k->size; n++)
+		total += abs(k->weights[n]);
+	if (total > INT_MAX / 255)
+	{
+		fprintf(stderr, "%s: the weights are too large\n", spec);
+		freeKernel(k);
+		return -1;
+	}
+
+	k->shift = -1;
+	for (int s = 0; s < 31; s++)
+		if (k->divisor == 1 << s)
+			k->shift = s;
+
+	// sums of 16 bit lanes can't overflow
+	k->narrow = k->shift >= 0 && k->shift < 15 && total <= SHRT_MAX / 255;
+
+	k->surround = 1;
+	for (int n = 0; n < k->size * k->size; n++)
+		if (n != k->size * k->size / 2 && k->weights[n] != k->weights[0])
+			k->surround = 0;
+
+	k->symmetric = 1;
+	for (int i = 0; i < k->size; i++)
+		for (int j = 0; j < k->radius; j++)
+			if (k->weights[i * k->size + j] != k->weights[i * k->size + k->size - 1 - j])
+				k->symmetric = 0;
+
+	k->row = (int *) malloc(2 * k->size * sizeof(int));
+	if (k->row == NULL)
+	{
+		freeKernel(k);
+		return -1;
+	}
+	k->column = k->row + k->size;
+	k->separable = factorKernel(k);
+
+	return 0;
+}
+
+int loadKernel(const char *spec, struct kernel *k)
+{
+	const char *plus = strchr(spec, '+');
+	char *first;
+
+	// Laplacian of Gaussian: the edge detection filter over a 3x3 blur
+	if (strcmp(spec, "log") == 0)
+	{
+		spec = "gauss3+edge";
+		plus = spec + 6;
+	}
+
+	if (plus == NULL)
+		return loadStage(spec, k);
+
+	if (strchr(plus + 1, '+') != NULL)
+	{
+		fprintf(stderr, "%s: at most two stages\n", spec);
+		return -1;
+	}
+
+	first = (char *) malloc(plus - spec + 1);
+	if (first == NULL)
+		return -1;
+	memcpy(first, spec, plus - spec);
+	first[plus - spec] = '\0';
+
+	if (loadStage(first, k) != 0)
+	{
+		free(first);
+		return -1;
+	}
+	free(first);
+
+	k->next = (struct kernel *) malloc(sizeof(struct kernel));
+	if (k->next == NULL || loadStage(plus + 1, k->next) != 0)
+	{
+		free(k->next);
+		k->next = NULL;
+		freeKernel(k);
+		return -1;
+	}
+
+	return 0;
+}
+
+int kernelRadius(const struct kernel *k)
+{
+	return k->radius + (k->next != NULL ? k->next->radius : 0);
+}
+
+void freeKernel(struct kernel *k)
+{
+	if (k->next != NULL)
+	{
+		freeKernel(k->next);
+		free(k->next);
+		k->next = NULL;
+	}
+	free(k->weights);
+	free(k->row);
+	k->weights = NULL;
+	k->row = NULL;
+	k->column = NULL;
+}
+
+//Scalar spans; size is a constant in the 3x3 and 5x5 versions, so their tap
+//loops are unrolled
+static inline __attribute__((always_inline))
+void spanScalarN(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+				 unsigned long j, unsigned long end, int channels, const int size)
+{
+	const int radius = size / 2;
+
+	for (; j < end; j++)
+	{
+		const int *w = k->weights;
+		int sum = 0;
+
+#pragma GCC unroll 8
+		for (int fi = 0; fi < size; fi++, w += size)
+		{
+			const unsigned char *p = rows[fi] + j - radius * channels;
+
+#pragma GCC unroll 8
+			for (int fj = 0; fj < size; fj++)
+				sum += (int)p[fj * channels] * w[fj];
+		}
+
+		out[j] = (unsigned char)(sum / k->divisor);
+	}
+}
+
+static void spanScalar3(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+						unsigned long j, unsigned long end, int channels)
+{
+	spanScalarN(k, rows, out, j, end, channels, 3);
+}
+
+static void spanScalar5(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+						unsigned long j, unsigned long end, int channels)
+{
+	spanScalarN(k, rows, out, j, end, channels, 5);
+}
+
+static void spanScalar(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+					   unsigned long j, unsigned long end, int channels)
+{
+	if (k->size == 3)
+		spanScalar3(k, rows, out, j, end, channels);
+	else if (k->size == 5)
+		spanScalar5(k, rows, out, j, end, channels);
+	else
+		spanScalarN(k, rows, out, j, end, channels, k->size);
+}
+
+#ifdef HAVE_X86_SIMD
+//8 pixels per step in 32 bit lanes, so any kernel that passed loadKernel
+//fits; symmetric kernels add the mirrored pixels before the multiply
+
+__attribute__((target("avx2")))
+static inline __m256i load8(const unsigned char *p)
+{
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+}
+
+//Divide like the scalar code: truncate towards zero
+__attribute__((target("avx2")))
+static inline __m256i divide8(const struct kernel *k, __m256i sum)
+{
+	if (k->shift >= 0)
+	{
+		__m256i bias = _mm256_and_si256(_mm256_srai_epi32(sum, 31), _mm256_set1_epi32(k->divisor - 1));
+
+		return _mm256_sra_epi32(_mm256_add_epi32(sum, bias), _mm_cvtsi32_si128(k->shift));
+	}
+
+	__m256d divisor = _mm256_set1_pd((double)k->divisor);
+	__m128i lo = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)), divisor));
+	__m128i hi = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)), divisor));
+
+	return _mm256_set_m128i(hi, lo);
+}
+
+//Store the low byte of every lane, like the cast to unsigned char
+__attribute__((target("avx2")))
+static inline void store8(unsigned char *out, __m256i v)
+{
+	const __m256i pick = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+										  0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	__m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pick),
+												_mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+
+	_mm_storel_epi64((__m128i *)out, _mm256_castsi256_si128(bytes));
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline))
+unsigned long spanAVX2N(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+						unsigned long j, unsigned long end, int channels, const int size)
+{
+	const int radius = size / 2;
+
+	for (; j + 8 <= end; j += 8)
+	{
+		const int *w = k->weights;
+		__m256i sum = _mm256_setzero_si256();
+
+#pragma GCC unroll 8
+		for (int fi = 0; fi < size; fi++, w += size)
+		{
+			const unsigned char *p = rows[fi] + j - radius * channels;
+
+			if (k->symmetric)
+			{
+#pragma GCC unroll 8
+				for (int fj = 0; fj < radius; fj++)
+				{
+					__m256i pair = _mm256_add_epi32(load8(p + fj * channels),
+													load8(p + (size - 1 - fj) * channels));
+
+					sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(pair, _mm256_set1_epi32(w[fj])));
+				}
+				sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(load8(p + radius * channels),
+															   _mm256_set1_epi32(w[radius])));
+			}
+			else
+			{
+#pragma GCC unroll 8
+				for (int fj = 0; fj < size; fj++)
+					sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(load8(p + fj * channels),
+																   _mm256_set1_epi32(w[fj])));
+			}
+		}
+
+		store8(out + j, divide8(k, sum));
+	}
+
+	return j;
+}
+
+//16 pixels per step in 16 bit lanes, for small kernels with a power of two
+//divisor (edge, gauss3, sobel, prewitt)
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline))
+unsigned long spanAVX2Narrow(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+							 unsigned long j, unsigned long end, int channels, const int size)
+{
+	const int radius = size / 2;
+	const __m128i shift = _mm_cvtsi32_si128(k->shift);
+
+	const int center = k->weights[radius * size + radius];
+	const int other = k->weights[0];
+
+	for (; j + 16 <= end; j += 16)
+	{
+		const int *w = k->weights;
+		__m256i sum = _mm256_setzero_si256();
+
+		if (k->surround)
+		{
+			// (center - other) * pixel + other * (box sum), two multiplies
+			__m256i box = _mm256_setzero_si256();
+
+#pragma GCC unroll 8
+			for (int fi = 0; fi < size; fi++)
+			{
+				const unsigned char *p = rows[fi] + j - radius * channels;
+
+#pragma GCC unroll 8
+				for (int fj = 0; fj < size; fj++)
+					box = _mm256_add_epi16(box, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + fj * channels))));
+			}
+
+			__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[radius] + j)));
+
+			sum = _mm256_add_epi16(_mm256_mullo_epi16(x, _mm256_set1_epi16((short)(center - other))),
+								   _mm256_mullo_epi16(box, _mm256_set1_epi16((short)other)));
+		}
+		else
+		{
+#pragma GCC unroll 8
+			for (int fi = 0; fi < size; fi++, w += size)
+			{
+				const unsigned char *p = rows[fi] + j - radius * channels;
+
+#pragma GCC unroll 8
+				for (int fj = 0; fj < size; fj++)
+				{
+					__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + fj * channels)));
+
+					// mirrored taps share one multiply
+					if (k->symmetric && fj < radius)
+					{
+						x = _mm256_add_epi16(x, _mm256_cvtepu8_epi16(
+							_mm_loadu_si128((const __m128i *)(p + (size - 1 - fj) * channels))));
+					}
+					else if (k->symmetric && fj > radius)
+						break;
+
+					sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(x, _mm256_set1_epi16((short)w[fj])));
+				}
+			}
+		}
+
+		// round towards zero, keep the low byte
+		sum = _mm256_add_epi16(sum, _mm256_and_si256(_mm256_srai_epi16(sum, 15),
+													 _mm256_set1_epi16((short)(k->divisor - 1))));
+		sum = _mm256_and_si256(_mm256_sra_epi16(sum, shift), _mm256_set1_epi16(0xff));
+
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0xD8);
+		_mm_storeu_si128((__m128i *)(out + j), _mm256_castsi256_si128(packed));
+	}
+
+	return j;
+}
+
+__attribute__((target("avx2")))
+static unsigned long spanAVX2(const struct kernel *k, const unsigned char *const *rows, unsigned char *out,
+							  unsigned long j, unsigned long end, int channels)
+{
+	if (k->narrow && k->size == 3)
+		j = spanAVX2Narrow(k, rows, out, j, end, channels, 3);
+	else if (k->narrow)
+		j = spanAVX2Narrow(k, rows, out, j, end, channels, k->size);
+
+	if (k->size == 3)
+		return spanAVX2N(k, rows, out, j, end, channels, 3);
+	if (k->size == 5)
+		return spanAVX2N(k, rows, out, j, end, channels, 5);
+
+	return spanAVX2N(k, rows, out, j, end, channels, k->size);
+}
+
+//Horizontal pass of a separable kernel: the row factor over one input row
+__attribute__((target("avx2")))
+static unsigned long horizontalAVX2(const struct kernel *k, const unsigned char *src, int *sums,
+									unsigned long j, unsigned long end, int channels)
+{
+	for (; j + 8 <= end; j += 8)
+	{
+		const unsigned char *p = src + j - k->radius * channels;
+		__m256i sum = _mm256_setzero_si256();
+
+		for (int t = 0; t < k->size; t++)
+			sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(load8(p + t * channels),
+														   _mm256_set1_epi32(k->row[t])));
+
+		_mm256_storeu_si256((__m256i *)(sums + j), sum);
+	}
+
+	return j;
+}
+
+//Vertical pass: the column factor over the row sums around the output row
+__attribute__((target("avx2")))
+static unsigned long verticalAVX2(const struct kernel *k, const int *const *sums, unsigned char *out,
+								  unsigned long j, unsigned long end)
+{
+	for (; j + 8 <= end; j += 8)
+	{
+		__m256i sum = _mm256_setzero_si256();
+
+		for (int s = 0; s < k->size; s++)
+			sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)(sums[s] + j)),
+														   _mm256_set1_epi32(k->column[s])));
+
+		store8(out + j, divide8(k, sum));
+	}
+
+	return j;
+}
+
+static int haveAVX2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#else
+static int haveAVX2(void)
+{
+	return 0;
+}
+#endif
+
+//One stage over the k->size rows of a window
+static void convolveStage(const struct kernel *k, const unsigned char *const *rows,
+						  unsigned char *out, unsigned long width, int channels, int simd)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned long border = (unsigned long)k->radius * channels;
+	const unsigned char *row = rows[k->radius];
+	unsigned long j = border;
+
+	//Border columns
+	if (width < (unsigned long)k->size)
+	{
+		memcpy(out, row, rowSize);
+		return;
+	}
+	memcpy(out, row, border);
+	memcpy(out + rowSize - border, row + rowSize - border, border);
+
+#ifdef HAVE_X86_SIMD
+	if (simd && haveAVX2())
+		j = spanAVX2(k, rows, out, j, rowSize - border, channels);
+#endif
+	spanScalar(k, rows, out, j, rowSize - border, channels);
+}
+
+//Copy the border columns of a two stage kernel from the input row
+static void copyBorder(const struct kernel *k, const unsigned char *row, unsigned char *out,
+					   unsigned long width, int channels)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned long border = (unsigned long)kernelRadius(k) * channels;
+
+	if (2 * border >= rowSize)
+	{
+		memcpy(out, row, rowSize);
+		return;
+	}
+	memcpy(out, row, border);
+	memcpy(out + rowSize - border, row + rowSize - border, border);
+}
+
+// First stage rows of convolveWindowFused, one buffer per thread since the
+// pipeline workers filter rows at the same time; it only grows, and is kept
+// until the process exits
+static __thread unsigned char *windowScratch;
+static __thread unsigned long windowScratchSize;
+
+//Two stage kernel over a window of kernelRadius(k) rows on each side; the
+//rows of the first stage go to a scratch buffer, this is only used by the
+//streaming modes
+static void convolveWindowFused(const struct kernel *k, const unsigned char *const *rows,
+								unsigned char *out, unsigned long width, int channels, int simd)
+{
+	const struct kernel *last = k->next;
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned long size = last->size * rowSize;
+	const unsigned char *stage[KERNEL_MAX_SIZE];
+	unsigned char *scratch = windowScratch;
+
+	if (size > windowScratchSize)
+	{
+		scratch = (unsigned char *) realloc(windowScratch, size * sizeof(unsigned char));
+		if (scratch == NULL)
+		{
+			fprintf(stderr, "can't allocate the kernel rows\n");
+			exit(1);
+		}
+		windowScratch = scratch;
+		windowScratchSize = size;
+	}
+
+	for (int s = 0; s < last->size; s++)
+	{
+		convolveStage(k, rows + s, scratch + s * rowSize, width, channels, simd);
+		stage[s] = scratch + s * rowSize;
+	}
+	convolveStage(last, stage, out, width, channels, simd);
+	copyBorder(k, rows[kernelRadius(k)], out, width, channels);
+}
+
+void convolveWindow(const struct kernel *k, const unsigned char *const *rows,
+					unsigned char *out, unsigned long width, int channels, int simd)
+{
+	if (k->next != NULL)
+		convolveWindowFused(k, rows, out, width, channels, simd);
+	else
+		convolveStage(k, rows, out, width, channels, simd);
+}
+
+//Separable kernels keep the horizontal sums of the last k->size rows in a
+//ring, so every input row is summed once instead of k->size times
+static int convolveRowsSeparable(const struct kernel *k, const unsigned char *in, unsigned char *out,
+								 unsigned long width, unsigned long height, int channels,
+								 unsigned long start, unsigned long end, int simd)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned long border = (unsigned long)k->radius * channels;
+	unsigned long radius = k->radius;
+	unsigned long next = 0;		// rows below next are in the ring
+	int avx2 = simd && haveAVX2();
+	const int *window[KERNEL_MAX_SIZE];
+	int *ring = (int *) malloc(k->size * rowSize * sizeof(int));
+
+	if (ring == NULL)
+		return -1;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = in + (i - start) * rowSize;
+		unsigned char *dst = out + (i - start) * rowSize;
+
+		//Border rows and columns
+		if (i < radius || i + radius >= height || width < (unsigned long)k->size)
+		{
+			memcpy(dst, row, rowSize);
+			continue;
+		}
+		memcpy(dst, row, border);
+		memcpy(dst + rowSize - border, row + rowSize - border, border);
+
+		for (unsigned long x = next > i - radius ? next : i - radius; x <= i + radius; x++)
+		{
+			const unsigned char *src = row + ((long)x - (long)i) * (long)rowSize;
+			int *sums = ring + (x % k->size) * rowSize;
+			unsigned long j = border;
+
+#ifdef HAVE_X86_SIMD
+			if (avx2)
+				j = horizontalAVX2(k, src, sums, j, rowSize - border, channels);
+#endif
+			for (; j < rowSize - border; j++)
+			{
+				const unsigned char *p = src + j - border;
+				int sum = 0;
+
+				for (int t = 0; t < k->size; t++)
+					sum += (int)p[t * channels] * k->row[t];
+				sums[j] = sum;
+			}
+		}
+		next = i + radius + 1;
+
+		for (int s = 0; s < k->size; s++)
+			window[s] = ring + ((i - radius + s) % k->size) * rowSize;
+
+		unsigned long j = border;
+
+#ifdef HAVE_X86_SIMD
+		if (avx2)
+			j = verticalAVX2(k, window, dst, j, rowSize - border);
+#endif
+		for (; j < rowSize - border; j++)
+		{
+			int sum = 0;
+
+			for (int s = 0; s < k->size; s++)
+				sum += window[s][j] * k->column[s];
+			dst[j] = (unsigned char)(sum / k->divisor);
+		}
+	}
+
+	free(ring);
+
+	return 0;
+}
+
+//Two stage kernels in one sweep: the rows of the first stage are kept in a
+//ring of k->next->size rows, so the intermediate image is never stored and
+//every first stage row is computed once per call; the first stage still
+//reads each input row k->size times
+static int convolveRowsFused(const struct kernel *k, const unsigned char *in, unsigned char *out,
+							 unsigned long width, unsigned long height, int channels,
+							 unsigned long start, unsigned long end, int simd)
+{
+	const struct kernel *last = k->next;
+	unsigned long rowSize = (unsigned long)channels * width;
+	unsigned long radius = kernelRadius(k);
+	unsigned long next = 0;		// first stage rows below next are in the ring
+	const unsigned char *window[KERNEL_MAX_SIZE];
+	unsigned char *ring = (unsigned char *) malloc(last->size * rowSize * sizeof(unsigned char));
+
+	if (ring == NULL)
+		return -1;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = in + (i - start) * rowSize;
+		unsigned char *dst = out + (i - start) * rowSize;
+
+		//Border rows
+		if (i < radius || i + radius >= height)
+		{
+			memcpy(dst, row, rowSize);
+			continue;
+		}
+
+		//First stage rows i - last->radius .. i + last->radius
+		for (unsigned long x = next > i - last->radius ? next : i - last->radius; x <= i + last->radius; x++)
+		{
+			for (int s = 0; s < k->size; s++)
+				window[s] = row + ((long)x + s - k->radius - (long)i) * (long)rowSize;
+			convolveStage(k, window, ring + (x % last->size) * rowSize, width, channels, simd);
+		}
+		next = i + last->radius + 1;
+
+		for (int s = 0; s < last->size; s++)
+			window[s] = ring + ((i - last->radius + s) % last->size) * rowSize;
+		convolveStage(last, window, dst, width, channels, simd);
+		copyBorder(k, row, dst, width, channels);
+	}
+
+	free(ring);
+
+	return 0;
+}
+
+void convolveRows(const struct kernel *k, const unsigned char *in, unsigned char *out,
+				  unsigned long width, unsigned long height, int channels,
+				  unsigned long start, unsigned long end, int simd)
+{
+	unsigned long rowSize = (unsigned long)channels * width;
+	const unsigned char *window[KERNEL_MAX_SIZE];
+
+	if (k->next != NULL)
+	{
+		if (convolveRowsFused(k, in, out, width, height, channels, start, end, simd) != 0)
+		{
+			fprintf(stderr, "can't allocate the kernel rows\n");
+			exit(1);
+		}
+		return;
+	}
+
+	// 3x3 kernels gain little from the two passes
+	if (k->separable && k->size > 3 &&
+		convolveRowsSeparable(k, in, out, width, height, channels, start, end, simd) == 0)
+		return;
+
+	for (unsigned long i = start; i < end; i++)
+	{
+		const unsigned char *row = in + (i - start) * rowSize;
+		unsigned char *dst = out + (i - start) * rowSize;
+
+		//Border rows
+		if (i < (unsigned long)k->radius || i + k->radius >= height)
+		{
+			memcpy(dst, row, rowSize);
+			continue;
+		}
+
+		for (int s = 0; s < k->size; s++)
+			window[s] = row + ((long)s - k->radius) * (long)rowSize;
+
+		convolveStage(k, window, dst, width, channels, simd);
+	}
+}
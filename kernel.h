@@ -0,0 +1,51 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+// Largest kernel side accepted, 2 * FILTER_MAX_RADIUS + 1
+#define KERNEL_MAX_SIZE 31
+
+// Square convolution kernel; out = (unsigned char)(sum / divisor), like the
+// built in edge detection filter
+struct kernel
+{
+	int size;			// taps per side, odd
+	int radius;			// size / 2
+	int divisor;
+	int shift;			// divisor == 1 << shift, -1 otherwise
+	int narrow;			// every sum fits in 16 bits and shift >= 0
+	int symmetric;		// every row reads the same from both ends
+	int surround;		// every weight but the center one is the same
+	int separable;		// weights[i][j] == column[i] * row[j]
+	int *weights;		// size * size, row major
+	int *row;			// horizontal factor of a separable kernel
+	int *column;		// vertical factor of a separable kernel
+	struct kernel *next;	// second stage, run over the output of this one
+};
+
+//Load a built in kernel by name (edge, sobelx, sobely, prewittx, prewitty,
+//gauss3, gauss5, box5, sharpen) or a kernel file: the side and the divisor
+//followed by side * side weights, row by row; # starts a comment
+//"first+second" chains two of them into one fused pass, "log" is gauss3+edge
+//Returns 0 on success and -1 on error
+int loadKernel(const char *spec, struct kernel *k);
+
+//Rows and columns of context on each side, over both stages
+int kernelRadius(const struct kernel *k);
+
+void freeKernel(struct kernel *k);
+
+//Convolve one row; rows holds the 2 * kernelRadius(k) + 1 rows around it,
+//top to bottom
+//The first and last kernelRadius(k) pixels are copied unchanged
+//simd = 0 keeps to the scalar code
+void convolveWindow(const struct kernel *k, const unsigned char *const *rows,
+					unsigned char *out, unsigned long width, int channels, int simd);
+
+//Convolve rows [start, end) of a width x height image, with the same
+//layout as filterRows; rows within k->radius of the image border are copied
+//Two stage kernels copy kernelRadius(k) rows and columns at the border
+void convolveRows(const struct kernel *k, const unsigned char *in, unsigned char *out,
+				  unsigned long width, unsigned long height, int channels,
+				  unsigned long start, unsigned long end, int simd);
+
+#endif
@@ -1,12 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 // #include "libjpeg/jpeglib.h"
 #include <jpeglib.h>
 #include <mpi.h>
+#include "filter.h"
+#include "jpegio.h"
+#include "bigmpi.h"
+#include "batch.h"
+#include "imagebuf.h"
+#include "canny.h"
 
-// compilare mpicc -o mpi mpi.c -ljpeg
-// rulare mpirun -np <nr_proc> ./mpi <image_in> <image_out>
+// compilare mpicc -O2 -o mpi mpi.c filter.c kernel.c jpegio.c bigmpi.c batch.c imagebuf.c canny.c -ljpeg
+// rulare mpirun -np <nr_proc> ./mpi [-m scalar|simd|boxsum|tiled] [-k kernel] [-d] [-e] [-w] [-t] [-r] [-b] [-g] <image_in|batch> <image_out|dir>
+//        mpirun -np <nr_proc> ./mpi [-d] [-g] -c low:high <image_in> <edges.pbm>
 // ex. mpirun -np 4 ./mpi in/house.pgm house_line.pgm
 
 typedef struct {
@@ -21,18 +29,39 @@ typedef struct {
 // unsigned char chunk3;
 // } image_chunks;
 
-// Gaussian noise reduction (sum /= 16)
-int edgeDetectionFilter[3][3] = {{-1, -1, -1},
-								 {-1, 8, -1},
-								 {-1, -1, -1}};
 
+// Rows of halo needed above and below a strip, the radius of the kernel
+unsigned long halo = 1;
+
+// Rows sent to rank 0 in one message
+#define GATHER_ROWS 64
+
+// Receive buffers rank 0 keeps posted while it encodes
+#define GATHER_WINDOW 8
+
+// The blocks of ranks 1..P-1 in image order; rank 0 receives them through
+// a ring of GATHER_WINDOW buffers, so it never holds the whole output
+struct gather
+{
+	int count;
+	int *proc;
+	int *tag;
+	unsigned long *first;
+	unsigned long *last;
+	unsigned char *ring;
+	unsigned long slotSize;
+	MPI_Request requests[GATHER_WINDOW];
+};
+
+// Intervals start on a multiple of rowAlign (one MCU row with -e)
+unsigned long rowAlign = 1;
 
 //Get the interval to process
 void getInterval(unsigned long *start, unsigned long *end, int rank, int P, unsigned long height) {
-	*start = rank * height / P;
-	*end = (rank + 1) * height / P;
+	*start = rank * height / P / rowAlign * rowAlign;
+	*end = (rank + 1) * height / P / rowAlign * rowAlign;
 
-	if (rank == P - 1 && height % P != 0)
+	if (rank == P - 1)
 		*end = height;
 } 
 
@@ -62,24 +91,34 @@ void readInput(const char *fileName, image *img)
  	//read the header    
   	jpeg_read_header(&info, TRUE);
 
+	//decode straight to luminance with -g
+	info.out_color_space = imageColorSpace();
+
   	// start decompression
   	jpeg_start_decompress(&info);
 
 	//get width and height
 	img->width = info.output_width;
 	img->height = info.output_height;
-	unsigned long data_size = (unsigned long)img->width * img->height * 3;
+	unsigned long data_size = (unsigned long)img->width * img->height * imageComponents;
     unsigned char* rowptr[1];
     unsigned char* jdata;
 
 	printf("Input image width and height: %lu %lu\n", (*img).width, (*img).height);
 
-	img->data = (unsigned char *)malloc(data_size * sizeof(unsigned char));
+	img->data = allocImage(data_size);
+	if (img->data == NULL)
+	{
+		fprintf(stderr, "can't allocate the image\n");
+		jpeg_destroy_decompress(&info);
+		fclose(input);
+		return;
+	}
 
 	while (info.output_scanline < info.output_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data 
-	    			+ 3 * info.output_width * info.output_scanline; 
+	    			+ imageComponents * info.output_width * info.output_scanline; 
 
 	    jpeg_read_scanlines(&info, rowptr, 1);
 	}
@@ -94,116 +133,852 @@ void readInput(const char *fileName, image *img)
 }
 
 
-void writeData(const char *fileName, image *img)
+//Rows per gather block; large enough that the block index fits in a tag
+unsigned long getBlockRows(unsigned long height) {
+	unsigned long blockRows = GATHER_ROWS;
+
+	while (height / blockRows >= 32767)
+		blockRows *= 2;
+
+	return blockRows;
+}
+
+//Number of gather blocks in the interval of a rank
+int getBlockCount(int rank, int P, unsigned long height) {
+	unsigned long start, end;
+	unsigned long blockRows = getBlockRows(height);
+
+	getInterval(&start, &end, rank, P, height);
+
+	return (int)((end - start + blockRows - 1) / blockRows);
+}
+
+//Get the rank whose interval holds a row
+int getOwner(unsigned long row, int P, unsigned long height) {
+	unsigned long start, end;
+
+	for (int proc = 0; proc < P; proc++)
+	{
+		getInterval(&start, &end, proc, P, height);
+		if (row >= start && row < end)
+			return proc;
+	}
+
+	return MPI_PROC_NULL;
+}
+
+//Check that every strip holds the halo rows its neighbours need from it
+int stripsFit(int P, unsigned long height) {
+	unsigned long start, end;
+
+	for (int proc = 0; proc < P; proc++)
+	{
+		getInterval(&start, &end, proc, P, height);
+		if (start < end && end - start < halo)
+			return 0;
+	}
+
+	return 1;
+}
+
+//Swap halo rows with the neighbouring strips
+//strip points to the first row of the interval, with halo rows of room
+//above and below it
+void exchangeHalos(unsigned char *strip, image *in, int rank, int P, MPI_Datatype rowType)
 {
-	FILE *out;
-  	JSAMPROW row_pointer[1];
-  	int row_stride;
-	struct jpeg_compress_struct info;
-	struct jpeg_error_mgr jerr; 
+	unsigned long start, end;
+	unsigned long rowSize = imageComponents * in->width;
+	int up = MPI_PROC_NULL;
+	int down = MPI_PROC_NULL;
+
+	getInterval(&start, &end, rank, P, in->height);
+	if (start == end)
+		return;
 
-	if ((out = fopen(fileName, "wb")) == NULL)
+	if (start > 0)
+		up = getOwner(start - 1, P, in->height);
+	if (end < in->height)
+		down = getOwner(end, P, in->height);
+
+	// first rows go up, last rows go down
+	MPI_Sendrecv(strip, (int)halo, rowType, up, 0,
+				 strip + (end - start) * rowSize, (int)halo, rowType, down, 0,
+				 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(strip + (end - start - halo) * rowSize, (int)halo, rowType, down, 1,
+				 strip - halo * rowSize, (int)halo, rowType, up, 1,
+				 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+//Apply filter on the rows of this rank, block by block
+//The other ranks send every block to rank 0 as soon as it is filtered,
+//unless sends is NULL
+void applyFilter(unsigned char *strip, unsigned char *outStrip, image *in, int rank, int P,
+				 MPI_Datatype rowType, MPI_Request *sends)
+{
+	unsigned long start, end;
+	unsigned long rowSize = imageComponents * in->width;
+	unsigned long blockRows = getBlockRows(in->height);
+
+	getInterval(&start, &end, rank, P, in->height);
+	for (unsigned long first = start, block = 0; first < end; first += blockRows, block++)
 	{
-	    fprintf(stderr, "can't open %s\n", fileName);
-	    exit(1);
+		unsigned long last = first + blockRows < end ? first + blockRows : end;
+		unsigned long offset = (first - start) * rowSize;
+
+		filterRows(strip + offset, outStrip + offset, in->width, in->height, imageComponents, first, last);
+
+		if (sends != NULL)
+			MPI_Isend(outStrip + offset, (int)(last - first), rowType, 0, (int)block,
+					  MPI_COMM_WORLD, &sends[block]);
 	}
+}
 
-  	//init jpeg decompress object
-	jpeg_create_compress(&info);
 
-	//specify data dest
- 	jpeg_stdio_dest(&info, out);
+//Post the receive of gather block k into its ring slot
+void postBlock(struct gather *g, int k, MPI_Datatype rowType) {
+	int slot = k % GATHER_WINDOW;
 
-	//set width and height
-	info.image_width = img->width;
-	info.image_height = img->height;
-	info.input_components = 3;
-    info.in_color_space = JCS_RGB;
-    info.err = jpeg_std_error(&jerr); 
-	
-  	unsigned char* rowptr[1];
+	MPI_Irecv(g->ring + slot * g->slotSize, (int)(g->last[k] - g->first[k]), rowType,
+			  g->proc[k], g->tag[k], MPI_COMM_WORLD, &g->requests[slot]);
+}
+
+//Post the first receives, before rank 0 starts filtering
+//Returns 0 on success and -1 if the buffers can't be allocated
+int postReceives(struct gather *g, image *out, int P, MPI_Datatype rowType) {
+	unsigned long start, end;
+	unsigned long blockRows = getBlockRows(out->height);
+	int count = 0;
+
+	for (int proc = 1; proc < P; proc++)
+		count += getBlockCount(proc, P, out->height);
+
+	g->count = count;
+	g->proc = (int *) malloc((count + 1) * sizeof(int));
+	g->tag = (int *) malloc((count + 1) * sizeof(int));
+	g->first = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+	g->last = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+	g->slotSize = blockRows * imageComponents * out->width;
+	g->ring = (unsigned char *) malloc(GATHER_WINDOW * g->slotSize * sizeof(unsigned char));
+	if (g->proc == NULL || g->tag == NULL || g->first == NULL || g->last == NULL || g->ring == NULL)
+		return -1;
+
+	count = 0;
+	for (int proc = 1; proc < P; proc++)
+	{
+		getInterval(&start, &end, proc, P, out->height);
+		for (unsigned long first = start, block = 0; first < end; first += blockRows, block++)
+		{
+			g->proc[count] = proc;
+			g->tag[count] = (int)block;
+			g->first[count] = first;
+			g->last[count] = first + blockRows < end ? first + blockRows : end;
+			count++;
+		}
+	}
+
+	for (int k = 0; k < g->count && k < GATHER_WINDOW; k++)
+		postBlock(g, k, rowType);
+
+	return 0;
+}
 
-	printf("Output image width and height: %lu %lu\n", (*img).width, (*img).height);
 
-    jpeg_set_defaults(&info);
+//Compute the whole image; rows are encoded as soon as the blocks before
+//them have arrived
+//rank 0 filtered the first rootRows rows itself, into outStrip
+void computeImage(struct gather *g, unsigned char *outStrip, unsigned long rootRows,
+				  MPI_Datatype rowType, struct jpegWriter *writer) {
+	writeRows(writer, outStrip, rootRows);
 
-    jpeg_start_compress(&info, TRUE);
-	
-	while (info.next_scanline < info.image_height)
+	for (int k = 0; k < g->count; k++)
 	{
-	    rowptr[0] = (unsigned char *)img->data
-		            + 3 * info.image_width * info.next_scanline; 
+		int slot = k % GATHER_WINDOW;
+
+		MPI_Wait(&g->requests[slot], MPI_STATUS_IGNORE);
+		writeRows(writer, g->ring + slot * g->slotSize, g->last[k] - g->first[k]);
 
-	    jpeg_write_scanlines(&info, rowptr, 1);
+		// the slot is free again, reuse it for a later block
+		if (k + GATHER_WINDOW < g->count)
+			postBlock(g, k + GATHER_WINDOW, rowType);
 	}
 
-	jpeg_finish_compress(&info);
+	free(g->proc);
+	free(g->tag);
+	free(g->first);
+	free(g->last);
+	free(g->ring);
+}
+
+//Dynamic mode: rank 0 only encodes; the workers take the next block from a
+//counter on rank 0 with MPI_Fetch_and_op, read its rows and halo from the
+//image on rank 0 with MPI_Get and send the result tagged with the block
+//index, so faster ranks simply filter more blocks
+
+//Receive every block from any rank, in image order
+int postDynamicReceives(struct gather *g, image *out, MPI_Datatype rowType) {
+	unsigned long blockRows = getBlockRows(out->height);
+	int count = (int)((out->height + blockRows - 1) / blockRows);
 
-	fclose(out);
+	g->count = count;
+	g->proc = (int *) malloc((count + 1) * sizeof(int));
+	g->tag = (int *) malloc((count + 1) * sizeof(int));
+	g->first = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+	g->last = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+	g->slotSize = blockRows * imageComponents * out->width;
+	g->ring = (unsigned char *) malloc(GATHER_WINDOW * g->slotSize * sizeof(unsigned char));
+	if (g->proc == NULL || g->tag == NULL || g->first == NULL || g->last == NULL || g->ring == NULL)
+		return -1;
 
-	jpeg_destroy_compress(&info);
+	for (int k = 0; k < count; k++)
+	{
+		g->proc[k] = MPI_ANY_SOURCE;
+		g->tag[k] = k;
+		g->first[k] = k * blockRows;
+		g->last[k] = (k + 1) * blockRows < out->height ? (k + 1) * blockRows : out->height;
+	}
+
+	for (int k = 0; k < g->count && k < GATHER_WINDOW; k++)
+		postBlock(g, k, rowType);
+
+	return 0;
 }
 
-//Apply filter on sum x product of neighbours
-int computeSum(unsigned long row, unsigned long column, image *in)
+//Filter blocks until the counter runs past the last one
+void filterBlocks(image *in, MPI_Win counterWin, MPI_Win imageWin, MPI_Datatype rowType) {
+	unsigned long rowSize = imageComponents * in->width;
+	unsigned long blockRows = getBlockRows(in->height);
+	long blocks = (long)((in->height + blockRows - 1) / blockRows);
+	long one = 1;
+	long block;
+
+	// the result of a block is sent while the next one is filtered
+	unsigned char *strip = (unsigned char *) malloc((blockRows + 2 * halo) * rowSize * sizeof(unsigned char));
+	unsigned char *outBlocks = (unsigned char *) malloc(2 * blockRows * rowSize * sizeof(unsigned char));
+	MPI_Request sends[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+
+	if (strip == NULL || outBlocks == NULL)
+	{
+		fprintf(stderr, "can't allocate the blocks\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	MPI_Win_lock_all(0, counterWin);
+	MPI_Win_lock_all(0, imageWin);
+
+	for (int k = 0; ; k++)
+	{
+		MPI_Fetch_and_op(&one, &block, MPI_LONG, 0, 0, MPI_SUM, counterWin);
+		MPI_Win_flush(0, counterWin);
+		if (block >= blocks)
+			break;
+
+		unsigned long first = block * blockRows;
+		unsigned long last = first + blockRows < in->height ? first + blockRows : in->height;
+		unsigned long from = first >= halo ? first - halo : 0;
+		unsigned long to = last + halo <= in->height ? last + halo : in->height;
+		unsigned char *rows = strip + halo * rowSize;
+		unsigned char *outBlock = outBlocks + (k % 2) * blockRows * rowSize;
+
+		MPI_Get(rows - (first - from) * rowSize, (int)(to - from), rowType, 0,
+				(MPI_Aint)(from * rowSize), (int)(to - from), rowType, imageWin);
+		MPI_Win_flush(0, imageWin);
+
+		MPI_Wait(&sends[k % 2], MPI_STATUS_IGNORE);
+		filterRows(rows, outBlock, in->width, in->height, imageComponents, first, last);
+		MPI_Isend(outBlock, (int)(last - first), rowType, 0, (int)block, MPI_COMM_WORLD, &sends[k % 2]);
+	}
+
+	MPI_Win_unlock_all(imageWin);
+	MPI_Win_unlock_all(counterWin);
+	MPI_Waitall(2, sends, MPI_STATUSES_IGNORE);
+
+	free(strip);
+	free(outBlocks);
+}
+
+//Run the dynamic mode; in->data is the whole image on rank 0
+void dynamicFilter(image *in, int rank, MPI_Datatype rowType, const char *fileName) {
+	long next = 0;
+	MPI_Win counterWin, imageWin;
+	struct gather gather;
+	struct jpegWriter writer;
+	image out;
+
+	out.width = in->width;
+	out.height = in->height;
+
+	if (rank == 0 &&
+		(postDynamicReceives(&gather, &out, rowType) != 0 ||
+		 openWriter(&writer, fileName, out.width, out.height) != 0))
+		MPI_Abort(MPI_COMM_WORLD, 1);
+
+	MPI_Win_create(rank == 0 ? &next : NULL, rank == 0 ? sizeof(long) : 0, sizeof(long),
+				   MPI_INFO_NULL, MPI_COMM_WORLD, &counterWin);
+	MPI_Win_create(rank == 0 ? in->data : NULL, rank == 0 ? (MPI_Aint)(in->height * imageComponents * in->width) : 0, 1,
+				   MPI_INFO_NULL, MPI_COMM_WORLD, &imageWin);
+
+	if (rank == 0)
+	{
+		computeImage(&gather, NULL, 0, rowType, &writer);
+		closeWriter(&writer);
+	}
+	else
+	{
+		filterBlocks(in, counterWin, imageWin, rowType);
+	}
+
+	MPI_Win_free(&imageWin);
+	MPI_Win_free(&counterWin);
+}
+
+//Tile mode: the ranks form a grid (MPI_Cart_create) and every rank filters
+//one tile of the image, so wide images need much less halo per rank than
+//with full width strips
+
+// Tile of one rank, and the halo columns it needs on each side
+struct tile
 {
-	int sum = 0;
-	unsigned long rowIdx = row - 1;
-	unsigned long colIdx = column - 3;
+	unsigned long top;
+	unsigned long bottom;
+	unsigned long left;
+	unsigned long right;
+	unsigned long haloLeft;
+	unsigned long haloRight;
+	unsigned long stride;		// bytes per row, halo columns included
+};
+
+//Pick the grid with the shortest tile borders, so the least halo is exchanged
+//Returns -1 if the image is too small for any grid of P tiles
+int getGrid(int P, image *in, int dims[2]) {
+	double best = -1;
 
-	for (unsigned long i = rowIdx, fi = 0; i < rowIdx + 3; i++, fi++)
+	for (int rows = 1; rows <= P; rows++)
 	{
-		for (unsigned long j = colIdx, fj = 0; j < colIdx + 9; j += 3, fj++)
+		int cols = P / rows;
+		double border = (double)in->height / rows + (double)in->width / cols;
+
+		// rows and cols are at least 1 here
+		if (P % rows != 0 || (unsigned long)rows > in->height || (unsigned long)cols > in->width ||
+			in->height / rows < halo || in->width / cols < halo)
+			continue;
+
+		if (best < 0 || border < best)
 		{
-			sum += (int)(in->data[i * 3 * in->width + j]) * edgeDetectionFilter[fi][fj];
+			best = border;
+			dims[0] = rows;
+			dims[1] = cols;
 		}
 	}
 
-	return sum;
+	return best < 0 ? -1 : 0;
 }
 
-//Apply filter
-void applyFilter(image *in, image *out, int rank, int P)
-{
-	unsigned long start, end;
+//Tile of the rank at the given grid coordinates
+void getTile(struct tile *t, int coords[2], int dims[2], image *in) {
+	getInterval(&t->top, &t->bottom, coords[0], dims[0], in->height);
+	getInterval(&t->left, &t->right, coords[1], dims[1], in->width);
+	t->haloLeft = coords[1] > 0 ? halo : 0;
+	t->haloRight = coords[1] < dims[1] - 1 ? halo : 0;
+	t->stride = imageComponents * (t->haloLeft + t->right - t->left + t->haloRight);
+}
 
-	getInterval(&start, &end, rank, P, in->height);
-	for (unsigned long i = start; i < end; i++)
+//Datatype of the pixels of a tile, stored in rows of stride bytes
+MPI_Datatype getTileType(struct tile *t, unsigned long stride) {
+	MPI_Datatype type;
+
+	MPI_Type_vector((int)(t->bottom - t->top), (int)(imageComponents * (t->right - t->left)), (int)stride,
+					MPI_UNSIGNED_CHAR, &type);
+	MPI_Type_commit(&type);
+
+	return type;
+}
+
+//Exchange the halo columns of the tile rows first, then whole halo rows
+//together with their halo columns, which brings the corners along
+//tileIn has halo rows above and below the tile
+void exchangeTileHalos(unsigned char *tileIn, struct tile *t, MPI_Comm grid) {
+	int up, down, left, right;
+	unsigned long rows = t->bottom - t->top;
+	unsigned long haloRows = halo * t->stride;
+	unsigned char *first = tileIn + haloRows;
+	unsigned char *pixels = first + imageComponents * t->haloLeft;
+	unsigned long pixelsSize = imageComponents * (t->right - t->left);
+	MPI_Datatype column;
+
+	MPI_Cart_shift(grid, 0, 1, &up, &down);
+	MPI_Cart_shift(grid, 1, 1, &left, &right);
+
+	MPI_Type_vector((int)rows, (int)(imageComponents * halo), (int)t->stride, MPI_UNSIGNED_CHAR, &column);
+	MPI_Type_commit(&column);
+
+	MPI_Sendrecv(pixels, 1, column, left, 0,
+				 pixels + pixelsSize, 1, column, right, 0,
+				 grid, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(pixels + pixelsSize - imageComponents * halo, 1, column, right, 1,
+				 first, 1, column, left, 1,
+				 grid, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&column);
+
+	MPI_Sendrecv(first, (int)haloRows, MPI_UNSIGNED_CHAR, up, 2,
+				 first + rows * t->stride, (int)haloRows, MPI_UNSIGNED_CHAR, down, 2,
+				 grid, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(first + (rows - halo) * t->stride, (int)haloRows, MPI_UNSIGNED_CHAR, down, 3,
+				 tileIn, (int)haloRows, MPI_UNSIGNED_CHAR, up, 3,
+				 grid, MPI_STATUS_IGNORE);
+}
+
+//Run the tile mode; in->data is the whole image on rank 0
+//Rank 0 collects the tiles one grid row at a time and encodes that band
+void tileFilter(image *in, int rank, int P, int dims[2], const char *fileName) {
+	MPI_Comm grid;
+	int periods[2] = {0, 0};
+	int coords[2];
+	struct tile t;
+	unsigned long rowSize = imageComponents * in->width;
+
+	// no reordering, so rank 0 keeps the image and the writer
+	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid);
+	MPI_Cart_coords(grid, rank, 2, coords);
+	getTile(&t, coords, dims, in);
+
+	unsigned long rows = t.bottom - t.top;
+	unsigned char *tileIn = (unsigned char *) malloc((rows + 2 * halo) * t.stride * sizeof(unsigned char));
+	unsigned char *tileOut = (unsigned char *) malloc(rows * t.stride * sizeof(unsigned char));
+	MPI_Datatype local = getTileType(&t, t.stride);
+
+	if (tileIn == NULL || tileOut == NULL)
+	{
+		fprintf(stderr, "%d: can't allocate the tile\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// Scatter the tiles
+	if (rank == 0)
 	{
-		for (unsigned long j = 0; j < 3 * in->width; j++)
+		for (int proc = 0; proc < P; proc++)
+		{
+			struct tile other;
+			int otherCoords[2];
+
+			MPI_Cart_coords(grid, proc, 2, otherCoords);
+			getTile(&other, otherCoords, dims, in);
+
+			MPI_Datatype type = getTileType(&other, rowSize);
+			unsigned char *pixels = in->data + other.top * rowSize + imageComponents * other.left;
+
+			if (proc == 0)
+				MPI_Sendrecv(pixels, 1, type, 0, 0, tileIn + halo * t.stride + imageComponents * t.haloLeft, 1, local, 0, 0,
+							 grid, MPI_STATUS_IGNORE);
+			else
+				MPI_Send(pixels, 1, type, proc, 0, grid);
+			MPI_Type_free(&type);
+		}
+	}
+	else
+	{
+		MPI_Recv(tileIn + halo * t.stride + imageComponents * t.haloLeft, 1, local, 0, 0, grid, MPI_STATUS_IGNORE);
+	}
+
+	exchangeTileHalos(tileIn, &t, grid);
+
+	// The halo columns are filtered as border columns and dropped
+	filterRows(tileIn + halo * t.stride, tileOut, t.stride / imageComponents, in->height, imageComponents, t.top, t.bottom);
+
+	if (rank != 0)
+	{
+		MPI_Send(tileOut + imageComponents * t.haloLeft, 1, local, 0, 1, grid);
+	}
+	else
+	{
+		struct jpegWriter writer;
+		unsigned char *band = (unsigned char *) malloc((in->height / dims[0] + 1) * rowSize * sizeof(unsigned char));
+
+		if (band == NULL || openWriter(&writer, fileName, in->width, in->height) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+
+		for (int row = 0; row < dims[0]; row++)
 		{
-			//Border case
-			if (i < 1 || (rank == P-1 && i >= end - 1) ||
-				j < 3 || j >= 3 * in->width - 3)
+			unsigned long top, bottom;
+
+			// every tile of a grid row has the same rows
+			getInterval(&top, &bottom, row, dims[0], in->height);
+
+			for (int col = 0; col < dims[1]; col++)
 			{
-				out->data[i *  3 * in->width + j] = in->data[i * 3 * in->width + j];
-				continue;
+				int otherCoords[2] = {row, col};
+				struct tile other;
+				int proc;
+
+				MPI_Cart_rank(grid, otherCoords, &proc);
+				getTile(&other, otherCoords, dims, in);
+
+				MPI_Datatype type = getTileType(&other, rowSize);
+
+				if (proc == 0)
+					MPI_Sendrecv(tileOut + imageComponents * t.haloLeft, 1, local, 0, 1, band + imageComponents * other.left, 1, type, 0, 1,
+								 grid, MPI_STATUS_IGNORE);
+				else
+					MPI_Recv(band + imageComponents * other.left, 1, type, proc, 1, grid, MPI_STATUS_IGNORE);
+				MPI_Type_free(&type);
 			}
 
-			out->data[i * 3 * in->width + j] = (unsigned char)(computeSum(i, j, in) / 16);
+			writeRows(&writer, band, bottom - top);
 		}
+
+		closeWriter(&writer);
+		free(band);
 	}
+
+	MPI_Type_free(&local);
+	MPI_Comm_free(&grid);
+	free(tileIn);
+	free(tileOut);
 }
 
+//Write the strip of every rank straight into a binary PPM (P6) file, PGM
+//(P5) for grayscale images, with one collective call; rank 0 also writes
+//the header, so no rows are gathered and nobody holds the whole output
+void writeStrips(unsigned char *outStrip, image *out, int rank, int P,
+				 MPI_Datatype rowType, const char *fileName) {
+	unsigned long start, end;
+	char header[64];
+	int headerSize = snprintf(header, sizeof(header), "P%d\n%lu %lu\n255\n",
+							  imageComponents == 1 ? 5 : 6, out->width, out->height);
+	MPI_Offset offset;
+	MPI_File file;
+
+	if (MPI_File_open(MPI_COMM_WORLD, fileName, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+					  MPI_INFO_NULL, &file) != MPI_SUCCESS)
+	{
+		if (rank == 0)
+			fprintf(stderr, "can't open %s\n", fileName);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	// drop whatever an older, larger file had after the image
+	MPI_File_set_size(file, (MPI_Offset)headerSize + (MPI_Offset)out->height * imageComponents * out->width);
+
+	if (rank == 0)
+		MPI_File_write_at(file, 0, header, headerSize, MPI_CHAR, MPI_STATUS_IGNORE);
+
+	getInterval(&start, &end, rank, P, out->height);
+	offset = (MPI_Offset)headerSize + (MPI_Offset)start * imageComponents * out->width;
+	MPI_File_write_at_all(file, offset, outStrip, (int)(end - start), rowType, MPI_STATUS_IGNORE);
+
+	MPI_File_close(&file);
+
+	if (rank == 0)
+		printf("Output image width and height: %lu %lu\n", out->width, out->height);
+}
+
+//Swap the edge rows next to the strip borders with the neighbouring strips
+void exchangeEdgeRows(struct canny *c, int rank, int P, MPI_Datatype edgeRowType)
+{
+	unsigned long start, end;
+	int up = MPI_PROC_NULL;
+	int down = MPI_PROC_NULL;
+
+	getInterval(&start, &end, rank, P, c->height);
+	if (start == end)
+		return;
+
+	if (start > 0)
+		up = getOwner(start - 1, P, c->height);
+	if (end < c->height)
+		down = getOwner(end, P, c->height);
+
+	unsigned char *first = c->edges + (start - c->first) * c->width;
+	unsigned char *last = c->edges + (end - 1 - c->first) * c->width;
 
-//Compute the whole image
-void computeImage(image *out, int rank, int P) {
+	MPI_Sendrecv(first, 1, edgeRowType, up, 4,
+				 last + c->width, 1, edgeRowType, down, 4,
+				 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	MPI_Sendrecv(last, 1, edgeRowType, down, 5,
+				 first - c->width, 1, edgeRowType, up, 5,
+				 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+//Write the edge map of every strip into one PBM (P4) file, like writeStrips
+void writeEdgeStrips(struct canny *c, int rank, int P, const char *fileName) {
 	unsigned long start, end;
-	
-	if (rank != 0) 
+	unsigned long rowSize = edgeRowSize(c->width);
+	char header[64];
+	int headerSize = edgeMapHeader(header, sizeof(header), c->width, c->height);
+	MPI_Datatype packedType;
+	MPI_Offset offset;
+	MPI_File file;
+
+	getInterval(&start, &end, rank, P, c->height);
+
+	// one spare row, so an empty strip still gets a buffer
+	unsigned char *packed = (unsigned char *) malloc((end - start + 1) * rowSize * sizeof(unsigned char));
+	if (packed == NULL)
 	{
-		getInterval(&start, &end, rank, P, out->height);
-    		printf("%d: %ld %ld\n", rank, start * 3 * out->width, (end - start) * 3 * out->width);
-		MPI_Send(out->data + start * 3 * out->width, (end - start) * 3 * out->width, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-	} 
-	else 
+		fprintf(stderr, "%d: can't allocate the edge map\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	cannyPack(c, start, end, packed);
+
+	if (MPI_File_open(MPI_COMM_WORLD, fileName, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+					  MPI_INFO_NULL, &file) != MPI_SUCCESS)
 	{
-		for (int proc = 1; proc < P; proc++) 
+		if (rank == 0)
+			fprintf(stderr, "can't open %s\n", fileName);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	MPI_File_set_size(file, (MPI_Offset)headerSize + (MPI_Offset)c->height * rowSize);
+
+	if (rank == 0)
+		MPI_File_write_at(file, 0, header, headerSize, MPI_CHAR, MPI_STATUS_IGNORE);
+
+	MPI_Type_contiguous((int)rowSize, MPI_UNSIGNED_CHAR, &packedType);
+	MPI_Type_commit(&packedType);
+
+	offset = (MPI_Offset)headerSize + (MPI_Offset)start * rowSize;
+	MPI_File_write_at_all(file, offset, packed, (int)(end - start), packedType, MPI_STATUS_IGNORE);
+
+	MPI_Type_free(&packedType);
+	MPI_File_close(&file);
+	free(packed);
+
+	if (rank == 0)
+		printf("Output image width and height: %lu %lu\n", c->width, c->height);
+}
+
+//Canny edge map of the strip of this rank; strip holds CANNY_HALO rows
+//around the interval. Every stage before hysteresis runs over fewer halo
+//rows than the one before it, so no rows are exchanged until then;
+//hysteresis swaps the edge rows at the strip borders and grows the weak
+//pixels they reach, in rounds until no rank finds any
+void cannyStrip(unsigned char *strip, image *in, int rank, int P, int low, int high,
+				const char *fileName) {
+	unsigned long start, end;
+	unsigned long from[CANNY_HALO + 1];
+	unsigned long to[CANNY_HALO + 1];
+	struct canny c;
+	struct seedList stack = {NULL, 0, 0};
+	MPI_Datatype edgeRowType;
+
+	getInterval(&start, &end, rank, P, in->height);
+
+	// rows [from[n], to[n]) lie within n rows of the interval
+	for (unsigned long n = 0; n <= CANNY_HALO; n++)
+	{
+		from[n] = start >= n ? start - n : 0;
+		to[n] = end + n <= in->height ? end + n : in->height;
+	}
+
+	if (cannyAlloc(&c, in->width, in->height, from[CANNY_HALO], to[CANNY_HALO], low, high) != 0)
+	{
+		fprintf(stderr, "%d: can't allocate the edge detector\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	if (start < end)
+	{
+		cannyGray(&c, strip - (start - from[CANNY_HALO]) * imageComponents * in->width, imageComponents,
+				  from[CANNY_HALO], to[CANNY_HALO]);
+		cannySmooth(&c, from[2], to[2]);
+		cannyGradient(&c, from[1], to[1]);
+		cannySuppress(&c, start, end);
+		cannyStart(&c, start, end, &stack);
+	}
+
+	MPI_Type_contiguous((int)in->width, MPI_UNSIGNED_CHAR, &edgeRowType);
+	MPI_Type_commit(&edgeRowType);
+
+	while (1)
+	{
+		unsigned long count;
+		unsigned long total;
+
+		exchangeEdgeRows(&c, rank, P, edgeRowType);
+		count = cannySeeds(&c, start, end, &stack);
+		MPI_Allreduce(&count, &total, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+		if (total == 0)
+			break;
+		cannyGrow(&c, start, end, &stack);
+	}
+
+	MPI_Type_free(&edgeRowType);
+
+	if (rank == 0)
+		printf("successfully applied filter\n");
+
+	writeEdgeStrips(&c, rank, P, fileName);
+
+	freeSeeds(&stack);
+	cannyFree(&c);
+}
+
+//Compress the strip of every rank as one band of a restart-interval JPEG
+//and stitch the bands together on rank 0
+void gatherBands(unsigned char *outStrip, image *out, int rank, int P, const char *fileName) {
+	unsigned long start, end;
+	unsigned char *band = NULL;
+	unsigned long size = 0;
+
+	getInterval(&start, &end, rank, P, out->height);
+	if (start < end)
+		encodeBand(outStrip, out->width, end - start, &band, &size);
+
+	if (rank != 0)
+	{
+		MPI_Send(&size, 1, MPI_UNSIGNED_LONG, 0, 0, MPI_COMM_WORLD);
+		bigSend(band, size, 0, 1, MPI_COMM_WORLD);
+		free(band);
+		return;
+	}
+
+	unsigned char **bands = (unsigned char **) malloc(P * sizeof(unsigned char *));
+	unsigned long *sizes = (unsigned long *) malloc(P * sizeof(unsigned long));
+	int count = 0;
+
+	if (bands == NULL || sizes == NULL)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+
+	if (size > 0)
+	{
+		bands[count] = band;
+		sizes[count++] = size;
+	}
+
+	for (int proc = 1; proc < P; proc++)
+	{
+		MPI_Recv(&size, 1, MPI_UNSIGNED_LONG, proc, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		if (size == 0)
+			continue;
+
+		bands[count] = (unsigned char *) malloc(size * sizeof(unsigned char));
+		if (bands[count] == NULL)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		bigRecv(bands[count], size, proc, 1, MPI_COMM_WORLD);
+		sizes[count++] = size;
+	}
+
+	printf("Output image width and height: %lu %lu\n", out->width, out->height);
+
+	if (writeBands(fileName, bands, sizes, count, out->height) != 0)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+
+	for (int k = 0; k < count; k++)
+		free(bands[k]);
+	free(bands);
+	free(sizes);
+}
+
+//Batch mode: the small images are handed out one at a time through a
+//counter on rank 0, so every rank filters whole images on its own; the large
+//ones are filtered by all the ranks together, as with -w
+//Returns the number of images that failed, on rank 0
+int runBatch(int rank, int P, const char *source, const char *outDir) {
+	struct batch b;
+	long next = 0;
+	long one = 1;
+	long k;
+	int failed = 0;
+	int total = 0;
+	MPI_Win counterWin;
+
+	// every rank lists the batch, rank 0 reads the image sizes
+	if (readBatch(source, outDir, &b) != 0)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	if (rank == 0 && classifyBatch(&b) != 0)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	if (rank != 0 && (b.large = (char *) calloc(b.count + 1, sizeof(char))) == NULL)
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	MPI_Bcast(b.large, b.count, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+	printSizes = 0;
+	MPI_Barrier(MPI_COMM_WORLD);
+	double begin = MPI_Wtime();
+
+	// a single rank takes the images in order, without a window
+	if (P > 1)
+	{
+		MPI_Win_create(rank == 0 ? &next : NULL, rank == 0 ? sizeof(long) : 0, sizeof(long),
+					   MPI_INFO_NULL, MPI_COMM_WORLD, &counterWin);
+		MPI_Win_lock_all(0, counterWin);
+	}
+
+	while (1)
+	{
+		if (P > 1)
+		{
+			MPI_Fetch_and_op(&one, &k, MPI_LONG, 0, 0, MPI_SUM, counterWin);
+			MPI_Win_flush(0, counterWin);
+		}
+		else
+		{
+			k = next++;
+		}
+		if (k >= b.count)
+			break;
+
+		if (!b.large[k] && filterImage(b.inputs[k], b.outputs[k]) != 0)
+		{
+			fprintf(stderr, "%d: can't filter %s\n", rank, b.inputs[k]);
+			failed++;
+		}
+	}
+
+	if (P > 1)
+	{
+		MPI_Win_unlock_all(counterWin);
+		MPI_Win_free(&counterWin);
+	}
+
+	for (k = 0; k < b.count; k++)
+	{
+		image in;
+
+		if (!b.large[k])
+			continue;
+
+		if (P < 2)
+		{
+			if (filterImage(b.inputs[k], b.outputs[k]) != 0)
+				failed++;
+			continue;
+		}
+
+		in.width = 0;
+		in.height = 0;
+		in.data = NULL;
+		if (rank == 0)
+		{
+			readInput(b.inputs[k], &in);
+			if (in.data == NULL)
+				in.height = 0;
+		}
+
+		MPI_Bcast(&in.width, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&in.height, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+		if (in.height == 0)
 		{
-			getInterval(&start, &end, proc, P, out->height);
-	    		MPI_Recv(out->data + start * 3 * out->width, (end - start) * 3 * out->width, MPI_UNSIGNED_CHAR, proc, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			failed += rank == 0;
+			continue;
 		}
+
+		MPI_Datatype rowType;
+		MPI_Type_contiguous((int)(imageComponents * in.width), MPI_UNSIGNED_CHAR, &rowType);
+		MPI_Type_commit(&rowType);
+
+		dynamicFilter(&in, rank, rowType, b.outputs[k]);
+
+		MPI_Type_free(&rowType);
+		freeImage(in.data);
 	}
+
+	MPI_Reduce(&failed, &total, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (rank == 0)
+		reportBatch(b.count - total, total, MPI_Wtime() - begin);
+
+	freeBatch(&b);
+
+	return total;
 }
 
 int main(int argc, char * argv[]) {
@@ -217,72 +992,360 @@ int main(int argc, char * argv[]) {
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &P);
 
-	if (rank == 0) 
+	int opt;
+	int distributed = 0;
+	int parallelEncode = 0;
+	int dynamic = 0;
+	int tiles = 0;
+	int rawOutput = 0;
+	int batchMode = 0;
+	int cannyMode = 0;
+	int cannyLow = 0;
+	int cannyHigh = 0;
+	int dims[2];
+
+	while ((opt = getopt(argc, argv, "m:k:dewtrbc:g")) != -1)
 	{
-		// Read the input image
-		readInput(argv[1], &in);
+		switch (opt)
+		{
+		case 'm':
+			if (setFilterMode(optarg) != 0)
+			{
+				fprintf(stderr, "unknown filter mode %s\n", optarg);
+				MPI_Finalize();
+				return -1;
+			}
+			break;
+		case 'k':
+			if (setFilterKernel(optarg) != 0)
+			{
+				MPI_Finalize();
+				return -1;
+			}
+			break;
+		case 'd':
+			distributed = 1;
+			break;
+		case 'e':
+			parallelEncode = 1;
+			rowAlign = getBandAlign();
+			break;
+		case 'w':
+			dynamic = 1;
+			break;
+		case 't':
+			tiles = 1;
+			break;
+		case 'r':
+			rawOutput = 1;
+			break;
+		case 'b':
+			batchMode = 1;
+			break;
+		case 'g':
+			imageComponents = 1;
+			break;
+		case 'c':
+			if (parseThresholds(optarg, &cannyLow, &cannyHigh) != 0)
+			{
+				fprintf(stderr, "bad thresholds %s, expected low:high up to 2040\n", optarg);
+				MPI_Finalize();
+				return -1;
+			}
+			cannyMode = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-d] [-e] [-w] [-t] [-r] [-b] [-g] [-c low:high] <image_in|batch> <image_out|dir>\n", argv[0]);
+			MPI_Finalize();
+			return -1;
+		}
 	}
 
-    MPI_Bcast(&in.width, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&in.height, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
-    	
-	if (rank != 0)
-    {
-    	unsigned long data_size = in.width * in.height * 3;
-       	in.data = (unsigned char *) malloc(data_size * sizeof(unsigned char));
-   	}
-
-   	MPI_Datatype image_chuncks_type;
-	MPI_Type_contiguous((unsigned long)3 * in.width * in.height, MPI_UNSIGNED_CHAR, &image_chuncks_type);
-	MPI_Type_commit(&image_chuncks_type);
-
-	// ALSO TRY WITH Send and Recv if it's not working with Bcast
-	// if (rank == 0)
-	// {
-	// 	for (int i = 1; i < P; i++)
-	// 	{
-	// 		MPI_Send(in.data, 1, image_chuncks_type, i, 0, MPI_COMM_WORLD);
-	// 	}
-	// }
-
-	// if (rank != 0)
-	// {
-	// 	MPI_Recv(in.data, 1, image_chuncks_type, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);	
-	// }
-
-    MPI_Bcast(in.data, 1, image_chuncks_type, 0, MPI_COMM_WORLD);
+	if (argc - optind < 2)
+	{
+		fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-d] [-e] [-w] [-t] [-r] [-b] [-g] [-c low:high] <image_in|batch> <image_out|dir>\n", argv[0]);
+		MPI_Finalize();
+		return -1;
+	}
+
+	halo = cannyMode ? CANNY_HALO : filterRadius();
+
+	// The edge map is written by the strips of the ranks
+	if (cannyMode && (batchMode || dynamic || tiles || parallelEncode || rawOutput))
+	{
+		if (rank == 0)
+			printf("-c writes the edge map of the strips, ignoring -b, -w, -t, -e and -r\n");
+		batchMode = 0;
+		dynamic = 0;
+		tiles = 0;
+		parallelEncode = 0;
+		rawOutput = 0;
+		rowAlign = 1;
+	}
+
+	// Batch mode, <image_in> is a manifest or directory and <image_out> the
+	// output directory
+	if (batchMode)
+	{
+		int failed = runBatch(rank, P, argv[optind], argv[optind + 1]);
+
+		MPI_Finalize();
+
+		return failed == 0 ? 0 : -1;
+	}
+
+	// Every rank decodes its own rows only if they can be reached without
+	// decoding the ones before them
+	if (distributed && !canSkipRows())
+	{
+		if (rank == 0)
+			printf("libjpeg can't skip rows, decoding on rank 0\n");
+		distributed = 0;
+	}
+
+	// The PPM output is written by the strips of the ranks
+	if (rawOutput && (dynamic || tiles || parallelEncode))
+	{
+		if (rank == 0)
+			printf("-r writes the strips of the ranks, ignoring -w, -t and -e\n");
+		dynamic = 0;
+		tiles = 0;
+		parallelEncode = 0;
+		rowAlign = 1;
+	}
+
+	// The workers read their blocks from the image on rank 0
+	if (dynamic && P < 2)
+	{
+		printf("no workers, splitting the image evenly\n");
+		dynamic = 0;
+	}
+	else if (dynamic && (distributed || parallelEncode || tiles))
+	{
+		if (rank == 0)
+			printf("-w decodes and encodes on rank 0, ignoring -d, -e and -t\n");
+		distributed = 0;
+		parallelEncode = 0;
+		tiles = 0;
+		rowAlign = 1;
+	}
+	else if (tiles && (distributed || parallelEncode))
+	{
+		if (rank == 0)
+			printf("-t decodes and encodes on rank 0, ignoring -d and -e\n");
+		distributed = 0;
+		parallelEncode = 0;
+		rowAlign = 1;
+	}
+
+	in.data = NULL;
+
+	if (distributed)
+	{
+		if (readSize(argv[optind], &in.width, &in.height) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	else
+	{
+		if (rank == 0)
+		{
+			// Read the input image
+			readInput(argv[optind], &in);
+			if (in.data == NULL)
+				MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+
+		MPI_Bcast(&in.width, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&in.height, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	}
+
+	// Halo and gather counts are in rows, so they stay far below INT_MAX
+	unsigned long rowSize = imageComponents * in.width;
+	MPI_Datatype rowType;
+	MPI_Type_contiguous((int)rowSize, MPI_UNSIGNED_CHAR, &rowType);
+	MPI_Type_commit(&rowType);
+
+	if (tiles && getGrid(P, &in, dims) != 0)
+	{
+		if (rank == 0)
+			printf("the image is too small for %d tiles, splitting it in strips\n", P);
+		tiles = 0;
+	}
+
+	if (tiles || dynamic)
+	{
+		if (tiles)
+			tileFilter(&in, rank, P, dims, argv[optind + 1]);
+		else
+			dynamicFilter(&in, rank, rowType, argv[optind + 1]);
+
+		MPI_Type_free(&rowType);
+		MPI_Finalize();
+
+		if (rank == 0)
+			printf("successfully wrote data \n");
+
+		freeImage(in.data);
+
+		return 0;
+	}
+
+	unsigned long start, end;
+	getInterval(&start, &end, rank, P, in.height);
+
+	// the halo rows come from the neighbouring strip only
+	if (!distributed && !stripsFit(P, in.height))
+	{
+		if (rank == 0)
+			fprintf(stderr, "the strips of %d ranks are thinner than the kernel\n", P);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	unsigned char *stripBuffer = NULL;
+	unsigned char *strip;
+
+	if (distributed)
+	{
+		// Decode the strip and its halo rows straight from the file
+		unsigned long first = start >= halo ? start - halo : 0;
+		unsigned long last = end + halo <= in.height ? end + halo : in.height;
+
+		stripBuffer = allocImage((end - start + 2 * halo) * rowSize);
+		if (stripBuffer == NULL)
+		{
+			fprintf(stderr, "%d: can't allocate the strip\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		strip = stripBuffer + halo * rowSize;
+
+		if (start < end && readRows(argv[optind], first, last, strip - (start - first) * rowSize) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	else if (rank == 0)
+	{
+		// Send the strips; rank 0 keeps its strip in place in the full image
+		for (int proc = 1; proc < P; proc++)
+		{
+			unsigned long procStart, procEnd;
+
+			getInterval(&procStart, &procEnd, proc, P, in.height);
+			if (bigSend(in.data + procStart * rowSize, (procEnd - procStart) * rowSize, proc, 0,
+						MPI_COMM_WORLD) != MPI_SUCCESS)
+				MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+
+		strip = in.data;
+	}
+	else
+	{
+		stripBuffer = allocImage((end - start + 2 * halo) * rowSize);
+		if (stripBuffer == NULL)
+		{
+			fprintf(stderr, "%d: can't allocate the strip\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		strip = stripBuffer + halo * rowSize;
+		if (bigRecv(strip, (end - start) * rowSize, 0, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
+	if (!distributed)
+		exchangeHalos(strip, &in, rank, P, rowType);
 
 	if (rank == 0)
 		printf("successfully read input\n");
-	
+
+	if (cannyMode)
+	{
+		cannyStrip(strip, &in, rank, P, cannyLow, cannyHigh, argv[optind + 1]);
+
+		MPI_Type_free(&rowType);
+		MPI_Finalize();
+
+		if (rank == 0)
+			printf("successfully wrote data \n");
+
+		freeImage(stripBuffer);
+		freeImage(in.data);
+
+		return 0;
+	}
+
+	// Every rank holds only the output of its own strip
+	unsigned char *outStrip;
+
 	out.height = in.height;
 	out.width = in.width;
-	unsigned long data_size = (unsigned long)out.width * out.height * 3;
-	out.data = (unsigned char *) malloc(data_size * sizeof(unsigned char));
+	// one spare row, so an empty strip still gets a buffer
+	outStrip = allocImage((end - start + 1) * rowSize);
+	if (outStrip == NULL)
+	{
+		fprintf(stderr, "%d: can't allocate the output\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
 
 	if (rank == 0)
 		printf("successfully Initialized output\n");
 
+	// Post the receives first, so the other strips arrive while rank 0
+	// filters and encodes its own rows
+	MPI_Request *requests = NULL;
+	struct gather gather;
+	struct jpegWriter writer;
+
+	if (parallelEncode || rawOutput)
+	{
+		// every rank encodes or writes its own strip
+	}
+	else if (rank == 0)
+	{
+		if (postReceives(&gather, &out, P, rowType) != 0 ||
+			openWriter(&writer, argv[optind + 1], out.width, out.height) != 0)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	else
+	{
+		requests = (MPI_Request *) malloc((getBlockCount(rank, P, in.height) + 1) * sizeof(MPI_Request));
+		if (requests == NULL)
+			MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+
 	// Apply the filter on image on chunks
-	applyFilter(&in, &out, rank, P);
-	MPI_Barrier(MPI_COMM_WORLD);
+	applyFilter(strip, outStrip, &in, rank, P, rowType, requests);
 
 	if (rank == 0)
 		printf("successfully applied filter\n");
 
 	// Compute the whole image
-	computeImage(&out, rank, P);
+	if (rawOutput)
+	{
+		writeStrips(outStrip, &out, rank, P, rowType, argv[optind + 1]);
+	}
+	else if (parallelEncode)
+	{
+		gatherBands(outStrip, &out, rank, P, argv[optind + 1]);
+	}
+	else if (rank == 0)
+	{
+		computeImage(&gather, outStrip, end - start, rowType, &writer);
+		closeWriter(&writer);
+	}
+	else
+	{
+		MPI_Waitall(getBlockCount(rank, P, in.height), requests, MPI_STATUSES_IGNORE);
+	}
 
-	if (rank == 0)
-		writeData(argv[2], &out);
+	free(requests);
 
+	MPI_Type_free(&rowType);
 	MPI_Finalize();
 
 	if (rank == 0)
 		printf("successfully wrote data \n");
 
-	free(in.data);
-	free(out.data);
+	freeImage(outStrip);
+	freeImage(stripBuffer);
+	freeImage(in.data);
 
 	return 0;
 }
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+// Nodes counted by addNodeBytes; higher nodes share the last counter
+#define MAX_NODES 64
+
+// Pages of a range addNodeBytes asks the kernel about
+#define NODE_SAMPLES 16
+
+// The allowed CPUs grouped by node, and within a node the first thread of
+// every core before its SMT siblings
+static int order[CPU_SETSIZE];
+static int allowedCount = 0;
+static int nodeStart[MAX_NODES + 1];	// of every used node in order
+static int nodeCount = 0;
+static unsigned long nodeBytes[MAX_NODES];
+
+//Read a CPU list like 0-3,8-11 from a sysfs file into set
+//Returns 0 on success and -1 if the file can't be read
+static int readCpuList(const char *fileName, cpu_set_t *set)
+{
+	FILE *input = fopen(fileName, "r");
+	int first, last;
+	char separator;
+
+	if (input == NULL)
+		return -1;
+
+	CPU_ZERO(set);
+	while (fscanf(input, "%d", &first) == 1)
+	{
+		last = first;
+		if (fscanf(input, "%c", &separator) == 1 && separator == '-' &&
+			(fscanf(input, "%d", &last) != 1 || fscanf(input, "%c", &separator) != 1))
+			separator = '\n';
+
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+
+		if (separator != ',')
+			break;
+	}
+	fclose(input);
+
+	return 0;
+}
+
+//Nonzero unless cpu is the SMT sibling of a lower numbered CPU
+static int firstThread(int cpu)
+{
+	char fileName[128];
+	cpu_set_t siblings;
+
+	snprintf(fileName, sizeof(fileName), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if (readCpuList(fileName, &siblings) != 0)
+		return 1;
+
+	for (int other = 0; other < cpu; other++)
+		if (CPU_ISSET(other, &siblings))
+			return 0;
+
+	return 1;
+}
+
+//Append the CPUs of set that the process may use, cores first
+static void addNode(cpu_set_t *set, cpu_set_t *allowed)
+{
+	int start = allowedCount;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if (CPU_ISSET(cpu, set) && CPU_ISSET(cpu, allowed) && firstThread(cpu) == (pass == 0))
+				order[allowedCount++] = cpu;
+		}
+	}
+
+	if (allowedCount > start && nodeCount < MAX_NODES)
+		nodeStart[nodeCount++] = start;
+}
+
+void initPinning(void)
+{
+	cpu_set_t allowed, node;
+	char fileName[64];
+
+	allowedCount = 0;
+	nodeCount = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+
+	for (int k = 0; k < MAX_NODES; k++)
+	{
+		snprintf(fileName, sizeof(fileName), "/sys/devices/system/node/node%d/cpulist", k);
+		if (readCpuList(fileName, &node) == 0)
+			addNode(&node, &allowed);
+	}
+
+	// no NUMA information, one node of all the CPUs
+	if (allowedCount == 0)
+		addNode(&allowed, &allowed);
+
+	nodeStart[nodeCount] = allowedCount;
+}
+
+int getWorkerCpu(int index, int count)
+{
+	int share, node, first;
+
+	if (allowedCount == 0 || count <= 0)
+		return -1;
+
+	if (count > allowedCount)
+		return order[index % allowedCount];
+
+	// the nodes get a run of workers each, in proportion to their CPUs, and
+	// the workers of a node take its cores before the SMT siblings
+	share = (int)((long)index * allowedCount / count);
+	for (node = 0; nodeStart[node + 1] <= share; node++)
+		;
+	first = (int)(((long)nodeStart[node] * count + allowedCount - 1) / allowedCount);
+
+	return order[nodeStart[node] + (index - first) % (nodeStart[node + 1] - nodeStart[node])];
+}
+
+int pinThread(int index, int count)
+{
+	int cpu = getWorkerCpu(index, count);
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return -1;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+void addNodeBytes(const void *start, unsigned long size, unsigned long bytes)
+{
+	unsigned long pageSize = (unsigned long)sysconf(_SC_PAGESIZE);
+	void *pages[NODE_SAMPLES];
+	int status[NODE_SAMPLES];
+	int count;
+
+	if (size == 0)
+		return;
+
+	count = size < NODE_SAMPLES * pageSize ? (int)((size + pageSize - 1) / pageSize) : NODE_SAMPLES;
+	for (int k = 0; k < count; k++)
+		pages[k] = (void *)(((uintptr_t)start + k * (size / count)) & ~(uintptr_t)(pageSize - 1));
+
+	// without a node list, move_pages only reports where the pages are
+#ifdef SYS_move_pages
+	if (syscall(SYS_move_pages, 0, (unsigned long)count, pages, NULL, status, 0) != 0)
+#endif
+	{
+		for (int k = 0; k < count; k++)
+			status[k] = 0;
+	}
+
+	for (int k = 0; k < count; k++)
+	{
+		// pages not faulted in yet count to node 0
+		int node = status[k] < 0 ? 0 : status[k] < MAX_NODES ? status[k] : MAX_NODES - 1;
+
+		__atomic_add_fetch(&nodeBytes[node], bytes / count + (k == 0 ? bytes % count : 0), __ATOMIC_RELAXED);
+	}
+}
+
+void reportNodeBandwidth(double seconds)
+{
+	for (int node = 0; node < MAX_NODES; node++)
+	{
+		unsigned long bytes = __atomic_exchange_n(&nodeBytes[node], 0, __ATOMIC_RELAXED);
+
+		if (bytes == 0)
+			continue;
+
+		printf("node %d: %.1f MB in %.3f s, %.2f GB/s\n", node, bytes / 1e6, seconds,
+			   seconds > 0 ? bytes / seconds / 1e9 : 0.0);
+	}
+}
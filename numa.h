@@ -0,0 +1,26 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+//Remember the CPUs the process may run on and the NUMA node of each, read
+//from the cpulist files of the nodes in sysfs; call it before pinning
+//anything
+void initPinning(void);
+
+//CPU for worker index of count: the nodes get a run of workers each, in
+//proportion to their allowed CPUs, and a node's workers take a core each
+//before any SMT sibling; -1 if initPinning found no CPU
+int getWorkerCpu(int index, int count);
+
+//Pin the calling thread to the CPU of worker index of count
+//Returns 0 on success and -1 on error
+int pinThread(int index, int count);
+
+//Count bytes of traffic to the memory of [start, start + size) to the NUMA
+//nodes that hold its pages, in proportion to a sample of them
+void addNodeBytes(const void *start, unsigned long size, unsigned long bytes);
+
+//Print the memory bandwidth of every node over the given time and reset the
+//counts
+void reportNodeBandwidth(double seconds);
+
+#endif
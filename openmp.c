@@ -1,12 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "libjpeg/jpeglib.h"
+#include "filter.h"
+#include "jpegio.h"
+#include "batch.h"
+#include "imagebuf.h"
+#include "numa.h"
+#include "canny.h"
 #include <omp.h>
 
-// compilare gcc -o openmp -fopenmp openmp.c
+// compilare gcc -O2 -o openmp -fopenmp openmp.c filter.c kernel.c jpegio.c batch.c imagebuf.c numa.c canny.c -ljpeg
 // export OMP_NUM_THREADS=4
-// rulare ./openmp <image_in> <image_out>
+// rulare ./openmp [-m scalar|simd|boxsum|tiled] [-k kernel] [-e] [-n] [-b] [-g] [-L interleaved|planar] <image_in|batch> <image_out|dir>
+//        ./openmp [-n] [-g] -c low:high <image_in> <edges.pbm>
+//        ./openmp [-m scalar|simd|boxsum|tiled] [-k kernel] [-n] -l <socket>
 // ex. ./openmp in/house.jpg house_line.jpg 
 
 typedef struct {
@@ -15,11 +29,44 @@ typedef struct {
 	unsigned char *data;
 } image;
 
-// Gaussian noise reduction (sum /= 16)
-int edgeDetectionFilter[3][3] = {{-1, -1, -1},
-								 {-1, 8, -1},
-								 {-1, -1, -1}};
+int numaMode = 0;	// pinned threads, bandwidth per NUMA node
+int cannyMode = 0;	// Canny edge map instead of the filter
+int planar = 0;		// filter every channel as a plane of its own
+int cannyLow;
+int cannyHigh;
 
+//Pin thread i of the team to a CPU of its own, spread over the sockets; the
+//runtime keeps the same threads for the later parallel regions
+void pinThreads(void)
+{
+	int failed = 0;
+
+	initPinning();
+
+	#pragma omp parallel reduction(+:failed)
+	failed += pinThread(omp_get_thread_num(), omp_get_num_threads()) != 0;
+
+	if (failed > 0)
+		printf("can't pin %d threads\n", failed);
+}
+
+
+//Fault in the pages of an image buffer on the threads that will filter
+//them, with the row split of applyFilter
+void touchImage(unsigned char *data, unsigned long width, unsigned long height)
+{
+	unsigned long rowSize = imageComponents * width;
+
+	#pragma omp parallel
+	{
+		int thread = omp_get_thread_num();
+		int threads = omp_get_num_threads();
+		unsigned long start = thread * height / threads;
+		unsigned long end = (thread + 1) * height / threads;
+
+		touchPages(data + start * rowSize, (end - start) * rowSize);
+	}
+}
 
 //Read a given image
 void readInput(const char *fileName, image *img)
@@ -47,24 +94,35 @@ void readInput(const char *fileName, image *img)
  	//read the header    
   	jpeg_read_header(&info, TRUE);
 
+	//decode straight to luminance with -g
+	info.out_color_space = imageColorSpace();
+
   	// start decompression
   	jpeg_start_decompress(&info);
 
 	//get width and height
 	img->width = info.output_width;
 	img->height = info.output_height;
-	unsigned long data_size = (unsigned long) img->width * img->height * 3;
+	unsigned long data_size = (unsigned long) img->width * img->height * imageComponents;
     unsigned char* rowptr[1];
     unsigned char* jdata;
 
 	printf("Input image width and height: %lu %lu\n", (*img).width, (*img).height);
 
-	img->data = (unsigned char *)malloc(data_size * sizeof(unsigned char));
+	img->data = allocImage(data_size);
+	if (img->data == NULL)
+	{
+		fprintf(stderr, "can't allocate the image\n");
+		jpeg_destroy_decompress(&info);
+		fclose(input);
+		return;
+	}
+	touchImage(img->data, img->width, img->height);
 
 	while (info.output_scanline < info.output_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data 
-	    			+ 3 * info.output_width * info.output_scanline; 
+	    			+ imageComponents * info.output_width * info.output_scanline; 
 
 	    jpeg_read_scanlines(&info, rowptr, 1);
 	}
@@ -102,8 +160,8 @@ void writeData(const char *fileName, image *img)
 	//set width and height
 	info.image_width = img->width;
 	info.image_height = img->height;
-	info.input_components = 3;
-    info.in_color_space = JCS_RGB;
+	info.input_components = imageComponents;
+    info.in_color_space = imageColorSpace();
     info.err = jpeg_std_error(&jerr); 
 	
   	unsigned char* rowptr[1];
@@ -117,7 +175,7 @@ void writeData(const char *fileName, image *img)
 	while (info.next_scanline < info.image_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data
-		            + 3 * info.image_width * info.next_scanline; 
+		            + imageComponents * info.image_width * info.next_scanline; 
 
 	    jpeg_write_scanlines(&info, rowptr, 1);
 	}
@@ -129,76 +187,624 @@ void writeData(const char *fileName, image *img)
 	jpeg_destroy_compress(&info);
 }
 
-//Compute sum of neighbours product
-int computeSum(unsigned long row, unsigned long column, image *in)
+//Compress bands of rows on all threads and stitch them with restart markers
+void writeDataParallel(const char *fileName, image *img)
 {
-	int sum = 0;
-	unsigned long rowIdx = row - 1;
-	unsigned long colIdx = column - 3;
+	unsigned long rowSize = imageComponents * img->width;
+	// a few bands per thread, so the threads stay busy until the end
+	unsigned long bandRows = getBandRows(img->height, 4 * omp_get_max_threads());
+	int count = (int)((img->height + bandRows - 1) / bandRows);
+	unsigned char **bands = (unsigned char **)calloc(count, sizeof(unsigned char *));
+	unsigned long *sizes = (unsigned long *)calloc(count, sizeof(unsigned long));
+
+	if (bands == NULL || sizes == NULL)
+	{
+		fprintf(stderr, "can't allocate the bands\n");
+		exit(1);
+	}
 
-	for (unsigned long i = rowIdx, fi = 0; i < rowIdx + 3; i++, fi++)
+	printf("Output image width and height: %lu %lu\n", img->width, img->height);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int k = 0; k < count; k++)
 	{
-		for (unsigned long j = colIdx, fj = 0; j < colIdx + 9; j += 3, fj++)
-		{
-			sum += (int)(in->data[i * 3 * in->width + j]) * edgeDetectionFilter[fi][fj];
-		}
+		unsigned long first = k * bandRows;
+		unsigned long last = first + bandRows < img->height ? first + bandRows : img->height;
+
+		encodeBand(img->data + first * rowSize, img->width, last - first, &bands[k], &sizes[k]);
 	}
 
-	return sum;
+	if (writeBands(fileName, bands, sizes, count, img->height) != 0)
+		exit(1);
+
+	for (int k = 0; k < count; k++)
+		free(bands[k]);
+	free(bands);
+	free(sizes);
 }
 
 //Apply filter
 void applyFilter(image *in, image *out)
 {
-	unsigned long i, j;
+	unsigned long rowSize = imageComponents * in->width;
 
-	// no need to make i private; it is already private
-	#pragma omp parallel for private (j)
-	for (i = 0; i < in->height; i++)
+	// one contiguous block of rows per thread, so the row kernels can carry
+	// state (e.g. the boxsum column sums) from one row to the next
+	#pragma omp parallel
 	{
-		for (j = 0; j < 3 * in->width; j++)
+		int thread = omp_get_thread_num();
+		int threads = omp_get_num_threads();
+		unsigned long start = thread * in->height / threads;
+		unsigned long end = (thread + 1) * in->height / threads;
+
+		if (planar && imageComponents > 1)
 		{
-			//Border case
-			if (i < 1 || i >= in->height - 1 ||
-				j < 3 || j >= 3 * in->width - 3)
-			{
-				out->data[i *  3 * in->width + j] = in->data[i * 3 * in->width + j];
-				continue;
-			}
+			// out holds the planes and in, read by now, the filtered ones;
+			// the barriers keep the halo rows and the joined rows apart
+			deinterleaveRows(in->data + start * rowSize, out->data,
+							 in->width, in->height, imageComponents, start, end);
+			#pragma omp barrier
+			filterPlanes(out->data, in->data, in->width, in->height, imageComponents, start, end);
+			#pragma omp barrier
+			interleaveRows(in->data, out->data + start * rowSize,
+						   in->width, in->height, imageComponents, start, end);
+		}
+		else
+		{
+			filterRows(in->data + start * rowSize, out->data + start * rowSize,
+					   in->width, in->height, imageComponents, start, end);
+		}
 
-			out->data[i * 3 * in->width + j] = (unsigned char)(computeSum(i, j, in) / 16);
+		if (numaMode)
+		{
+			addNodeBytes(in->data + start * rowSize, (end - start) * rowSize, (end - start) * rowSize);
+			addNodeBytes(out->data + start * rowSize, (end - start) * rowSize, (end - start) * rowSize);
 		}
 	}
 }
 
 
-int main(int argc, char * argv[]) {
+//Filter one image with all the threads
+int processImage(const char *inName, const char *outName, int parallelEncode)
+{
 	image in;
 	image out;
 
-	readInput(argv[1], &in);
+	in.data = NULL;
+	readInput(inName, &in);
+	if (in.data == NULL)
+		return -1;
 
 	printf("successfully read input\n");
 	
 	out.height = in.height;
 	out.width = in.width;
-	unsigned long data_size = (unsigned long) out.width * out.height * 3;
-	out.data = (unsigned char *)malloc(data_size * sizeof(unsigned char));
+	unsigned long data_size = (unsigned long) out.width * out.height * imageComponents;
+	out.data = allocImage(data_size);
 	if (out.data == NULL)
+	{
+		freeImage(in.data);
 		return -1;
+	}
+	touchImage(out.data, out.width, out.height);
 
 	printf("successfully Initialized output\n");
 
+	double begin = omp_get_wtime();
+
 	applyFilter(&in, &out);
 
+	if (numaMode)
+		reportNodeBandwidth(omp_get_wtime() - begin);
+
 	printf("successfully applied filter\n");
 
-	writeData(argv[2], &out);
+	if (parallelEncode)
+		writeDataParallel(outName, &out);
+	else
+		writeData(outName, &out);
 
 	printf("successfully wrote data \n");
 
-	free(in.data);
-	free(out.data);
+	freeImage(in.data);
+	freeImage(out.data);
+
+	return 0;
+}
+
+//Canny edge map of one image, each thread on a block of rows; the stages
+//meet at barriers and hysteresis goes on in rounds until no weak pixel
+//next to a block border is reached from the block beside it
+int cannyImage(const char *inName, const char *outName)
+{
+	image in;
+	struct canny c;
+	unsigned long found[2] = {0, 0};	// seeds of even and odd rounds
+
+	in.data = NULL;
+	readInput(inName, &in);
+	if (in.data == NULL)
+		return -1;
+
+	printf("successfully read input\n");
+
+	if (cannyAlloc(&c, in.width, in.height, 0, in.height, cannyLow, cannyHigh) != 0)
+	{
+		fprintf(stderr, "can't allocate the edge detector\n");
+		freeImage(in.data);
+		return -1;
+	}
+
+	double begin = omp_get_wtime();
+
+	#pragma omp parallel
+	{
+		int thread = omp_get_thread_num();
+		int threads = omp_get_num_threads();
+		unsigned long start = thread * in.height / threads;
+		unsigned long end = (thread + 1) * in.height / threads;
+		struct seedList stack = {NULL, 0, 0};
+
+		cannyGray(&c, in.data + start * imageComponents * in.width, imageComponents, start, end);
+		#pragma omp barrier
+		cannySmooth(&c, start, end);
+		#pragma omp barrier
+		cannyGradient(&c, start, end);
+		#pragma omp barrier
+		cannySuppress(&c, start, end);
+		#pragma omp barrier
+		cannyStart(&c, start, end, &stack);
+
+		for (int round = 0; ; round++)
+		{
+			// the neighbours are done growing before their rows are read
+			#pragma omp barrier
+			unsigned long count = cannySeeds(&c, start, end, &stack);
+
+			#pragma omp atomic
+			found[round % 2] += count;
+			#pragma omp barrier
+
+			if (found[round % 2] == 0)
+				break;
+			cannyGrow(&c, start, end, &stack);
+
+			// nobody reads the other counter until the next barrier
+			if (thread == 0)
+				found[(round + 1) % 2] = 0;
+		}
+
+		// the stage buffers of these rows were all written first by this
+		// thread, so they sit on the node of its gray rows
+		if (numaMode)
+		{
+			addNodeBytes(in.data + start * imageComponents * in.width, imageComponents * (end - start) * in.width,
+						 imageComponents * (end - start) * in.width);
+			addNodeBytes(c.gray + start * in.width, (end - start) * in.width, 6 * (end - start) * in.width);
+		}
+
+		freeSeeds(&stack);
+	}
+
+	if (numaMode)
+		reportNodeBandwidth(omp_get_wtime() - begin);
+
+	printf("successfully applied filter\n");
+	printf("Output image width and height: %lu %lu\n", in.width, in.height);
+
+	int result = writeEdgeMap(&c, outName);
+
+	if (result == 0)
+		printf("successfully wrote data \n");
+
+	cannyFree(&c);
+	freeImage(in.data);
+
+	return result;
+}
+
+//Filter the images of a batch: the small ones several at once, each on one
+//thread, then the large ones one at a time with all the threads
+int runBatch(const char *source, const char *outDir, int parallelEncode)
+{
+	struct batch b;
+	int failed = 0;
+
+	if (readBatch(source, outDir, &b) != 0 || classifyBatch(&b) != 0)
+		return -1;
+
+	printSizes = 0;
+	double begin = getTime();
+
+	#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+	for (int k = 0; k < b.count; k++)
+	{
+		if (b.large[k])
+			continue;
+
+		if (filterImage(b.inputs[k], b.outputs[k]) != 0)
+		{
+			fprintf(stderr, "can't filter %s\n", b.inputs[k]);
+			failed++;
+		}
+	}
+
+	for (int k = 0; k < b.count; k++)
+	{
+		if (b.large[k] && processImage(b.inputs[k], b.outputs[k], parallelEncode) != 0)
+			failed++;
+	}
+
+	reportBatch(b.count - failed, failed, getTime() - begin);
+	freeBatch(&b);
+
+	return failed == 0 ? 0 : -1;
+}
+
+// Server mode: jobs come over a Unix domain socket and are filtered one at
+// a time by the OpenMP team, which stays alive between them, with the image
+// buffers kept from one job to the next. A connection sends any number of
+// jobs, integers in native byte order:
+//   'P' <uint32 length> <input path> <uint32 length> <output path>
+//       -> <uint32 status>, 0 on success
+//   'J' <uint64 length> <JPEG bytes>
+//       -> <uint64 length> <filtered JPEG bytes>, length 0 on error
+// Paths longer than PATH_MAX end the connection; JPEGs over MAX_REQUEST_SIZE
+// are read and dropped, and answered with length 0
+#define MAX_REQUEST_SIZE (256UL << 20)
+
+struct server
+{
+	image in;
+	image out;
+	unsigned long inCapacity;
+	unsigned long outCapacity;
+	unsigned char *request;		// the JPEG of a job
+	unsigned long requestCapacity;
+};
+
+//Make *buffer hold at least size bytes, keeping it when it is big enough
+int growBuffer(unsigned char **buffer, unsigned long *capacity, unsigned long size)
+{
+	if (size <= *capacity)
+		return 0;
+
+	free(*buffer);
+	*buffer = (unsigned char *)malloc(size * sizeof(unsigned char));
+	*capacity = *buffer != NULL ? size : 0;
+
+	return *buffer != NULL ? 0 : -1;
+}
+
+//Read exactly size bytes; returns -1 at the end of the connection
+int readAll(int fd, void *buffer, unsigned long size)
+{
+	unsigned char *next = (unsigned char *)buffer;
+
+	while (size > 0)
+	{
+		ssize_t count = read(fd, next, size);
+
+		if (count <= 0)
+			return -1;
+		next += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+//Read and drop size bytes, to stay in step with the client
+int skipAll(int fd, uint64_t size)
+{
+	unsigned char buffer[65536];
+
+	while (size > 0)
+	{
+		unsigned long count = size < sizeof(buffer) ? size : sizeof(buffer);
+
+		if (readAll(fd, buffer, count) != 0)
+			return -1;
+		size -= count;
+	}
+
+	return 0;
+}
+
+int writeAll(int fd, const void *buffer, unsigned long size)
+{
+	const unsigned char *next = (const unsigned char *)buffer;
+
+	while (size > 0)
+	{
+		ssize_t count = write(fd, next, size);
+
+		if (count <= 0)
+			return -1;
+		next += count;
+		size -= count;
+	}
 
 	return 0;
 }
+
+//Filter the JPEG in server->request; the result is a malloc'ed JPEG
+int filterJpeg(struct server *server, unsigned long size, unsigned char **jpeg, unsigned long *jpegSize)
+{
+	if (decodeMemory(server->request, size, &server->in.data, &server->inCapacity,
+					 &server->in.width, &server->in.height) != 0)
+		return -1;
+
+	server->out.width = server->in.width;
+	server->out.height = server->in.height;
+	if (growBuffer(&server->out.data, &server->outCapacity, imageComponents * server->in.width * server->in.height) != 0)
+		return -1;
+
+	applyFilter(&server->in, &server->out);
+
+	return encodeMemory(server->out.data, server->out.width, server->out.height, jpeg, jpegSize);
+}
+
+//Read a whole file into server->request
+int readRequestFile(struct server *server, const char *fileName, unsigned long *size)
+{
+	FILE *input = fopen(fileName, "rb");
+	long length;
+	int result = -1;
+
+	if (input == NULL)
+		return -1;
+
+	if (fseek(input, 0, SEEK_END) == 0 && (length = ftell(input)) > 0 &&
+		fseek(input, 0, SEEK_SET) == 0 &&
+		growBuffer(&server->request, &server->requestCapacity, length) == 0 &&
+		fread(server->request, 1, length, input) == (size_t)length)
+	{
+		*size = length;
+		result = 0;
+	}
+
+	fclose(input);
+
+	return result;
+}
+
+//Read a length prefixed path
+int readPath(int fd, char **path)
+{
+	uint32_t length;
+
+	if (readAll(fd, &length, sizeof(length)) != 0 || length > PATH_MAX)
+		return -1;
+
+	*path = (char *)malloc((size_t)length + 1);
+	if (*path == NULL)
+		return -1;
+
+	(*path)[length] = '\0';
+
+	return readAll(fd, *path, length);
+}
+
+//Serve one job of a connection; returns -1 when the connection ends
+int serveJob(int fd, struct server *server)
+{
+	unsigned char *jpeg = NULL;
+	unsigned long jpegSize = 0;
+	char type;
+
+	if (readAll(fd, &type, 1) != 0)
+		return -1;
+
+	if (type == 'P')
+	{
+		char *inName = NULL;
+		char *outName = NULL;
+		unsigned long size;
+		uint32_t status = 1;
+		FILE *output;
+
+		if (readPath(fd, &inName) == 0 && readPath(fd, &outName) == 0)
+		{
+			if (readRequestFile(server, inName, &size) == 0 &&
+				filterJpeg(server, size, &jpeg, &jpegSize) == 0 &&
+				(output = fopen(outName, "wb")) != NULL)
+			{
+				status = fwrite(jpeg, 1, jpegSize, output) == jpegSize ? 0 : 1;
+				status |= fclose(output) != 0;
+			}
+			else
+			{
+				fprintf(stderr, "can't filter %s\n", inName);
+			}
+		}
+		else
+		{
+			free(inName);
+			free(outName);
+			return -1;
+		}
+
+		free(inName);
+		free(outName);
+		free(jpeg);
+
+		return writeAll(fd, &status, sizeof(status));
+	}
+
+	if (type == 'J')
+	{
+		uint64_t size;
+		uint64_t replySize;
+
+		if (readAll(fd, &size, sizeof(size)) != 0)
+			return -1;
+
+		if (size > MAX_REQUEST_SIZE)
+		{
+			fprintf(stderr, "request of %llu bytes is too large\n", (unsigned long long)size);
+			if (skipAll(fd, size) != 0)
+				return -1;
+		}
+		else
+		{
+			if (growBuffer(&server->request, &server->requestCapacity, size) != 0 ||
+				readAll(fd, server->request, size) != 0)
+				return -1;
+
+			if (filterJpeg(server, size, &jpeg, &jpegSize) != 0)
+				jpegSize = 0;
+		}
+		replySize = jpegSize;
+
+		int result = writeAll(fd, &replySize, sizeof(replySize));
+
+		if (result == 0)
+			result = writeAll(fd, jpeg, jpegSize);
+		free(jpeg);
+
+		return result;
+	}
+
+	fprintf(stderr, "unknown job type %d\n", type);
+
+	return -1;
+}
+
+//Listen on a Unix domain socket and serve its connections one after another
+int runServer(const char *socketName)
+{
+	struct sockaddr_un address;
+	struct server server;
+	int listener;
+
+	memset(&server, 0, sizeof(server));
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketName) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "socket path too long: %s\n", socketName);
+		return -1;
+	}
+	strcpy(address.sun_path, socketName);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketName);
+	if (listener < 0 ||
+		bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+		listen(listener, 16) != 0)
+	{
+		perror(socketName);
+		return -1;
+	}
+
+	// a client that goes away must not end the server
+	signal(SIGPIPE, SIG_IGN);
+	printSizes = 0;
+
+	printf("listening on %s\n", socketName);
+	fflush(stdout);
+
+	while (1)
+	{
+		int client = accept(listener, NULL, NULL);
+
+		if (client < 0)
+			continue;
+
+		while (serveJob(client, &server) == 0)
+			;
+
+		close(client);
+	}
+
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+	int parallelEncode = 0;
+	int batchMode = 0;
+	const char *socketName = NULL;
+
+	while ((opt = getopt(argc, argv, "m:k:enbl:c:gL:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			if (setFilterMode(optarg) != 0)
+			{
+				fprintf(stderr, "unknown filter mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			if (setFilterKernel(optarg) != 0)
+			{
+				return -1;
+			}
+			break;
+		case 'e':
+			parallelEncode = 1;
+			break;
+		case 'n':
+			numaMode = 1;
+			break;
+		case 'b':
+			batchMode = 1;
+			break;
+		case 'l':
+			socketName = optarg;
+			break;
+		case 'g':
+			imageComponents = 1;
+			break;
+		case 'L':
+			if (strcmp(optarg, "planar") == 0)
+				planar = 1;
+			else if (strcmp(optarg, "interleaved") == 0)
+				planar = 0;
+			else
+			{
+				fprintf(stderr, "unknown layout %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			if (parseThresholds(optarg, &cannyLow, &cannyHigh) != 0)
+			{
+				fprintf(stderr, "bad thresholds %s, expected low:high up to 2040\n", optarg);
+				return -1;
+			}
+			cannyMode = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-e] [-n] [-b] [-g] [-L interleaved|planar] [-l socket] [-c low:high] <image_in|batch> <image_out|dir>\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (numaMode)
+		pinThreads();
+
+	if (socketName != NULL)
+		return runServer(socketName);
+
+	if (argc - optind < 2)
+	{
+		fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-e] [-n] [-b] [-g] [-L interleaved|planar] [-l socket] [-c low:high] <image_in|batch> <image_out|dir>\n", argv[0]);
+		return -1;
+	}
+
+	if (cannyMode)
+	{
+		if (batchMode)
+			fprintf(stderr, "-c works on a single image, -b is ignored\n");
+		return cannyImage(argv[optind], argv[optind + 1]);
+	}
+
+	if (batchMode)
+		return runBatch(argv[optind], argv[optind + 1], parallelEncode);
+
+	return processImage(argv[optind], argv[optind + 1], parallelEncode);
+}
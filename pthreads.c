@@ -1,11 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 #include "libjpeg/jpeglib.h"
-
-// compilare gcc -o pthreads pthreads.c -lpthread -ljpeg
-// rulare ./pthreads <image_in> <image_out>
+#include "filter.h"
+#include "threadpool.h"
+#include "jpegio.h"
+#include "batch.h"
+#include "imagebuf.h"
+#include "numa.h"
+#include "canny.h"
+
+// compilare gcc -O2 -o pthreads pthreads.c filter.c kernel.c threadpool.c jpegio.c batch.c imagebuf.c numa.c canny.c -lpthread -ljpeg
+// rulare ./pthreads [-m scalar|simd|boxsum|tiled] [-k kernel] [-p] [-e] [-n] [-g] [-L interleaved|planar] [-t threads] <image_in> <image_out> [<image_in> <image_out> ...]
+//        ./pthreads [-m scalar|simd|boxsum|tiled] [-k kernel] [-p] [-e] [-n] [-g] [-L interleaved|planar] [-t threads] -b <manifest|directory> <out_dir>
+//        ./pthreads [-n] [-g] [-t threads] -c low:high <image_in> <edges.pbm> [<image_in> <edges.pbm> ...]
 // ex. ./pthreads in/house.jpg house_line.jpg
 
 typedef struct {
@@ -14,24 +24,73 @@ typedef struct {
 	unsigned char *data;
 } image;
 
-struct interval
+// Rows per task handed to the thread pool
+#define TILE_ROWS 32
+
+// Rows handed to a filter worker at once in pipeline mode
+#define BLOCK_ROWS 16
+
+// Decoder -> filter workers -> encoder pipeline over a ring of rows.
+// Row r lives in slot r % ringRows of both rings; a slot is reused once
+// the rows that need it have been encoded.
+struct pipeline
 {
-	int thread_id;
-	unsigned long start;
-	unsigned long end;
+	struct jpeg_decompress_struct *decoder;
+	struct jpeg_compress_struct *encoder;
+	unsigned long width;
+	unsigned long height;
+	unsigned long radius;		// halo rows of the kernel
+	unsigned long ringRows;
+	unsigned char *inRing;
+	unsigned char *outRing;
+	unsigned long *done;		// last block filtered + 1, per block % ringBlocks
+	unsigned long ringBlocks;
+	unsigned long decoded;		// rows decoded so far
+	unsigned long encoded;		// rows encoded so far
+	unsigned long nextBlock;	// next block for a filter worker
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
 };
 
-// Gaussian noise reduction (sum /= 16)
-int edgeDetectionFilter[3][3] = {{-1, -1, -1},
-								 {-1, 8, -1},
-								 {-1, -1, -1}};
-
 image in;
 image out;
-int P = 24;
+int P = 0;	// worker threads, 0 = one per online CPU
+int numaMode = 0;	// pinned workers, bandwidth per NUMA node
+int cannyMode = 0;	// Canny edge maps instead of the filter
+int planar = 0;		// filter every channel as a plane of its own
+int cannyLow;
+int cannyHigh;
+struct canny edges;
+
+// Canny stage run over the tiles of the image
+typedef void (*canny_stage)(struct canny *c, unsigned long start, unsigned long end);
+
+// Hysteresis over one strip of rows per worker
+struct hysteresis
+{
+	int strips;
+	struct seedList *stacks;	// one per strip
+	unsigned long found;		// seeds of the current round
+};
+
+//Fault in the pages of one tile of the buffer var, on the worker that
+//will most likely filter that tile
+void touchTask(void *var, unsigned long tile)
+{
+	unsigned char *data = (unsigned char *) var;
+	unsigned long rowSize = imageComponents * in.width;
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS;
+
+	if (end > in.height)
+		end = in.height;
+
+	touchPages(data + start * rowSize, (end - start) * rowSize);
+}
 
 //Read a given image
-void readInput(const char *fileName, image *img)
+//With a pool, the workers fault in the pages of the tiles they will filter
+void readInput(const char *fileName, image *img, struct threadpool *pool)
 {
 	FILE *input = NULL;
 	struct jpeg_decompress_struct info;
@@ -56,24 +115,36 @@ void readInput(const char *fileName, image *img)
  	//read the header    
   	jpeg_read_header(&info, TRUE);
 
+	//decode straight to luminance with -g
+	info.out_color_space = imageColorSpace();
+
   	// start decompression
   	jpeg_start_decompress(&info);
 
 	//get width and height
 	img->width = info.output_width;
 	img->height = info.output_height;
-	unsigned long data_size = (unsigned long) img->width * img->height * 3;
+	unsigned long data_size = (unsigned long) img->width * img->height * imageComponents;
     unsigned char* rowptr[1];
     unsigned char* jdata;
 
 	printf("Input image width and height: %lu %lu\n", (*img).width, (*img).height);
 
-	img->data = (unsigned char *)malloc(data_size * sizeof(unsigned char));
+	img->data = allocImage(data_size);
+	if (img->data == NULL)
+	{
+		fprintf(stderr, "can't allocate the image\n");
+		jpeg_destroy_decompress(&info);
+		fclose(input);
+		return;
+	}
+	if (pool != NULL)
+		poolRun(pool, touchTask, img->data, (img->height + TILE_ROWS - 1) / TILE_ROWS);
 
 	while (info.output_scanline < info.output_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data 
-	    			+ 3 * info.output_width * info.output_scanline; 
+	    			+ imageComponents * info.output_width * info.output_scanline; 
 
 	    jpeg_read_scanlines(&info, rowptr, 1);
 	}
@@ -111,8 +182,8 @@ void writeData(const char *fileName, image *img)
 	//set width and height
 	info.image_width = img->width;
 	info.image_height = img->height;
-	info.input_components = 3;
-    info.in_color_space = JCS_RGB;
+	info.input_components = imageComponents;
+    info.in_color_space = imageColorSpace();
     info.err = jpeg_std_error(&jerr); 
 	
   	unsigned char* rowptr[1];
@@ -126,7 +197,7 @@ void writeData(const char *fileName, image *img)
 	while (info.next_scanline < info.image_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data
-		            + 3 * info.image_width * info.next_scanline; 
+		            + imageComponents * info.image_width * info.next_scanline; 
 
 	    jpeg_write_scanlines(&info, rowptr, 1);
 	}
@@ -138,98 +209,710 @@ void writeData(const char *fileName, image *img)
 	jpeg_destroy_compress(&info);
 }
 
-//Compute sum of neighbours product
-int computeSum(unsigned long row, unsigned long column)
+//Apply filter on one tile of rows
+void applyFilter(void *var, unsigned long tile)
 {
-	int sum = 0;
-	unsigned long rowIdx = row - 1;
-	unsigned long colIdx = column - 3;
+	unsigned long rowSize = imageComponents * in.width;
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS;
+
+	if (end > in.height)
+		end = in.height;
+
+	filterRows(in.data + start * rowSize, out.data + start * rowSize,
+			   in.width, in.height, imageComponents, start, end);
 
-	for (unsigned long i = rowIdx, fi = 0; i < rowIdx + 3; i++, fi++)
+	if (numaMode)
 	{
-		for (unsigned long j = colIdx, fj = 0; j < colIdx + 9; j += 3, fj++)
-		{
-			sum += (int)(in.data[i * 3 * in.width + j]) * edgeDetectionFilter[fi][fj];
-		}
+		addNodeBytes(in.data + start * rowSize, (end - start) * rowSize, (end - start) * rowSize);
+		addNodeBytes(out.data + start * rowSize, (end - start) * rowSize, (end - start) * rowSize);
+	}
+}
+
+// Planar filtering: out holds the planes and in, read by then, the filtered
+// ones; each step is a poolRun of its own, so the halo rows of a tile are
+// split before it is filtered and read before they are joined
+
+//Split one tile of rows of the input into the planes
+void splitTask(void *var, unsigned long tile)
+{
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS < in.height ? start + TILE_ROWS : in.height;
+
+	deinterleaveRows(in.data + start * imageComponents * in.width, out.data,
+					 in.width, in.height, imageComponents, start, end);
+}
+
+void filterPlanesTask(void *var, unsigned long tile)
+{
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS < in.height ? start + TILE_ROWS : in.height;
+
+	filterPlanes(out.data, in.data, in.width, in.height, imageComponents, start, end);
+
+	// counted on the rows of the first plane, the others are placed alike
+	if (numaMode)
+	{
+		addNodeBytes(out.data + start * in.width, (end - start) * in.width, imageComponents * (end - start) * in.width);
+		addNodeBytes(in.data + start * in.width, (end - start) * in.width, imageComponents * (end - start) * in.width);
+	}
+}
+
+//Join one tile of rows of the filtered planes into the output
+void joinTask(void *var, unsigned long tile)
+{
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS < in.height ? start + TILE_ROWS : in.height;
+
+	interleaveRows(in.data, out.data + start * imageComponents * in.width,
+				   in.width, in.height, imageComponents, start, end);
+}
+
+// Bands of the output compressed in parallel
+struct bands
+{
+	unsigned long rows;
+	unsigned char **data;
+	unsigned long *sizes;
+};
+
+//Compress one band of the output image
+void encodeTask(void *var, unsigned long k)
+{
+	struct bands *bands = (struct bands *) var;
+	unsigned long first = k * bands->rows;
+	unsigned long last = first + bands->rows < out.height ? first + bands->rows : out.height;
+
+	encodeBand(out.data + first * imageComponents * out.width, out.width, last - first,
+			   &bands->data[k], &bands->sizes[k]);
+}
+
+//Compress bands of rows on the pool and stitch them with restart markers
+void writeDataParallel(struct threadpool *pool, const char *fileName)
+{
+	struct bands bands;
+
+	// a few bands per worker, so the workers stay busy until the end
+	bands.rows = getBandRows(out.height, 4 * poolSize(pool));
+
+	int count = (int)((out.height + bands.rows - 1) / bands.rows);
+
+	bands.data = (unsigned char **)calloc(count, sizeof(unsigned char *));
+	bands.sizes = (unsigned long *)calloc(count, sizeof(unsigned long));
+	if (bands.data == NULL || bands.sizes == NULL)
+	{
+		fprintf(stderr, "can't allocate the bands\n");
+		exit(1);
+	}
+
+	printf("Output image width and height: %lu %lu\n", out.width, out.height);
+
+	poolRun(pool, encodeTask, &bands, count);
+
+	if (writeBands(fileName, bands.data, bands.sizes, count, out.height) != 0)
+		exit(1);
+
+	for (int k = 0; k < count; k++)
+		free(bands.data[k]);
+	free(bands.data);
+	free(bands.sizes);
+}
+
+static unsigned char *ringRow(struct pipeline *pl, unsigned char *ring, unsigned long row)
+{
+	return ring + (row % pl->ringRows) * imageComponents * pl->width;
+}
+
+//Decode rows into the input ring
+void* decodeStage(void *var)
+{
+	struct pipeline *pl = (struct pipeline *) var;
+	unsigned char *rowptr[1];
+
+	for (unsigned long row = 0; row < pl->height; row++)
+	{
+		//Row row - ringRows is needed until row row - ringRows + radius is encoded
+		pthread_mutex_lock(&pl->lock);
+		while (row + pl->radius + 1 > pl->encoded + pl->ringRows)
+			pthread_cond_wait(&pl->changed, &pl->lock);
+		pthread_mutex_unlock(&pl->lock);
+
+		rowptr[0] = ringRow(pl, pl->inRing, row);
+		jpeg_read_scanlines(pl->decoder, rowptr, 1);
+
+		pthread_mutex_lock(&pl->lock);
+		pl->decoded = row + 1;
+		// wake the workers only when a block and its halo rows are complete
+		if (pl->decoded % BLOCK_ROWS == pl->radius % BLOCK_ROWS || pl->decoded == pl->height)
+			pthread_cond_broadcast(&pl->changed);
+		pthread_mutex_unlock(&pl->lock);
 	}
 
-	return sum;
+	pthread_exit(NULL);
 }
 
-//Apply filter
-void* applyFilter(void *var)
+//Filter blocks as soon as their rows and halo rows are decoded; one task
+//per worker of the pool, each taking blocks until there are none left
+void filterStage(void *var, unsigned long task)
 {
-	struct interval crtThread = *(struct interval*) var;
+	struct pipeline *pl = (struct pipeline *) var;
 
-	for (unsigned long i = crtThread.start; i < crtThread.end; i++)
+	while (1)
 	{
-		for (unsigned long j = 0; j < 3 * in.width; j++)
+		pthread_mutex_lock(&pl->lock);
+		unsigned long block = pl->nextBlock++;
+		unsigned long start = block * BLOCK_ROWS;
+		unsigned long end = start + BLOCK_ROWS;
+
+		if (start >= pl->height)
 		{
-			//Border case
-			if (i < 1 || i >= in.height - 1 ||
-				j < 3 || j >= 3 * in.width - 3)
+			pthread_mutex_unlock(&pl->lock);
+			break;
+		}
+		if (end > pl->height)
+			end = pl->height;
+
+		while (pl->decoded < end + pl->radius && pl->decoded < pl->height)
+			pthread_cond_wait(&pl->changed, &pl->lock);
+		pthread_mutex_unlock(&pl->lock);
+
+		for (unsigned long i = start; i < end; i++)
+		{
+			unsigned char *row = ringRow(pl, pl->inRing, i);
+			unsigned char *dst = ringRow(pl, pl->outRing, i);
+			const unsigned char *window[2 * FILTER_MAX_RADIUS + 1];
+
+			//Border rows
+			if (i < pl->radius || i + pl->radius >= pl->height)
 			{
-				out.data[i *  3 * in.width + j] = in.data[i * 3 * in.width + j];
+				memcpy(dst, row, imageComponents * pl->width);
 				continue;
 			}
 
-			out.data[i * 3 * in.width + j] = (unsigned char)(computeSum(i, j) / 16);
+			for (unsigned long t = 0; t < 2 * pl->radius + 1; t++)
+				window[t] = ringRow(pl, pl->inRing, i - pl->radius + t);
+			filterWindow(window, dst, pl->width, imageComponents);
 		}
+
+		pthread_mutex_lock(&pl->lock);
+		pl->done[block % pl->ringBlocks] = block + 1;
+		pthread_cond_broadcast(&pl->changed);
+		pthread_mutex_unlock(&pl->lock);
 	}
-	pthread_exit(NULL);
 }
 
+//Encode the filtered blocks in order
+void* encodeStage(void *var)
+{
+	struct pipeline *pl = (struct pipeline *) var;
+	unsigned char *rowptr[1];
 
-int main(int argc, char * argv[]) {
-	pthread_t tid[P];
-	int thread_id[P];
-	struct interval interval[P];
+	for (unsigned long block = 0; block * BLOCK_ROWS < pl->height; block++)
+	{
+		unsigned long start = block * BLOCK_ROWS;
+		unsigned long end = start + BLOCK_ROWS;
 
-	readInput(argv[1], &in);
+		if (end > pl->height)
+			end = pl->height;
 
-	printf("successfully read input\n");
+		pthread_mutex_lock(&pl->lock);
+		while (pl->done[block % pl->ringBlocks] != block + 1)
+			pthread_cond_wait(&pl->changed, &pl->lock);
+		pthread_mutex_unlock(&pl->lock);
 
-	// Initialize the threads
-	for(int i = 0; i < P; i++)
-		thread_id[i] = i;
+		for (unsigned long i = start; i < end; i++)
+		{
+			rowptr[0] = ringRow(pl, pl->outRing, i);
+			jpeg_write_scanlines(pl->encoder, rowptr, 1);
+		}
 
-	// Compute the work interval of each thread
-	for (int i = 0; i < P; i++) {	
-		interval[i].start = i * in.height/P;
-		interval[i].end = (i+1) * in.height/P;
-		interval[i].thread_id = i;
+		pthread_mutex_lock(&pl->lock);
+		pl->encoded = end;
+		pthread_cond_broadcast(&pl->changed);
+		pthread_mutex_unlock(&pl->lock);
 	}
-	
-	if (in.height % P != 0) {
-		interval[P-1].end = in.height-1;
-		interval[P-1].thread_id = P-1;
+
+	pthread_exit(NULL);
+}
+
+//Run decode, filter and encode concurrently over a bounded ring of rows;
+//the decoder and the encoder get a thread each, the workers of the pool
+//filter
+int pipelineFilter(struct threadpool *pool, const char *inName, const char *outName)
+{
+	FILE *input = NULL;
+	FILE *output = NULL;
+	struct jpeg_decompress_struct inInfo;
+	struct jpeg_compress_struct outInfo;
+	struct jpeg_error_mgr inErr;
+	struct jpeg_error_mgr outErr;
+	struct pipeline pl;
+	pthread_t decoder, encoder;
+	int workers = poolSize(pool);
+
+	if (inName == NULL ||
+		(input = fopen(inName, "rb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", inName);
+		return -1;
+	}
+
+	if ((output = fopen(outName, "wb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", outName);
+		fclose(input);
+		return -1;
 	}
 
-	// Initialize output image	
+	inInfo.err = jpeg_std_error(&inErr);
+	jpeg_create_decompress(&inInfo);
+	jpeg_stdio_src(&inInfo, input);
+	jpeg_read_header(&inInfo, TRUE);
+	inInfo.out_color_space = imageColorSpace();
+	jpeg_start_decompress(&inInfo);
+
+	pl.decoder = &inInfo;
+	pl.width = inInfo.output_width;
+	pl.height = inInfo.output_height;
+
+	printf("Input image width and height: %lu %lu\n", pl.width, pl.height);
+
+	outInfo.err = jpeg_std_error(&outErr);
+	jpeg_create_compress(&outInfo);
+	jpeg_stdio_dest(&outInfo, output);
+	outInfo.image_width = pl.width;
+	outInfo.image_height = pl.height;
+	outInfo.input_components = imageComponents;
+	outInfo.in_color_space = imageColorSpace();
+	jpeg_set_defaults(&outInfo);
+	jpeg_start_compress(&outInfo, TRUE);
+	pl.encoder = &outInfo;
+
+	// one block per worker in flight, plus room for the decoder to run ahead
+	// and for the halo rows of the kernel; the halo rows count as whole
+	// blocks, so the decoder can't get a full ring of blocks ahead of the
+	// encoder and no two blocks in flight share a done slot
+	pl.radius = filterRadius();
+	pl.ringBlocks = workers + 2 + (2 * pl.radius + BLOCK_ROWS - 1) / BLOCK_ROWS;
+	pl.ringRows = pl.ringBlocks * BLOCK_ROWS;
+	pl.inRing = (unsigned char *)malloc(2 * pl.ringRows * imageComponents * pl.width * sizeof(unsigned char));
+	pl.done = (unsigned long *)calloc(pl.ringBlocks, sizeof(unsigned long));
+	if (pl.inRing == NULL || pl.done == NULL)
+	{
+		fprintf(stderr, "can't allocate the pipeline buffers\n");
+		exit(1);
+	}
+	pl.outRing = pl.inRing + pl.ringRows * imageComponents * pl.width;
+	pl.decoded = 0;
+	pl.encoded = 0;
+	pl.nextBlock = 0;
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.changed, NULL);
+
+	pthread_create(&decoder, NULL, decodeStage, &pl);
+	pthread_create(&encoder, NULL, encodeStage, &pl);
+
+	poolRun(pool, filterStage, &pl, workers);
+
+	pthread_join(decoder, NULL);
+	pthread_join(encoder, NULL);
+
+	printf("Output image width and height: %lu %lu\n", pl.width, pl.height);
+
+	jpeg_finish_decompress(&inInfo);
+	jpeg_destroy_decompress(&inInfo);
+	fclose(input);
+
+	jpeg_finish_compress(&outInfo);
+	jpeg_destroy_compress(&outInfo);
+	fclose(output);
+
+	pthread_mutex_destroy(&pl.lock);
+	pthread_cond_destroy(&pl.changed);
+	free(pl.inRing);
+	free(pl.done);
+
+	return 0;
+}
+
+
+//Filter one image with all the workers of the pool
+int processImage(struct threadpool *pool, const char *inName, const char *outName, int parallelEncode)
+{
+	in.data = NULL;
+	readInput(inName, &in, pool);
+	if (in.data == NULL)
+		return -1;
+
+	printf("successfully read input\n");
+
+	// Initialize output image
 	out.height = in.height;
 	out.width = in.width;
-	unsigned long data_size = (unsigned long) out.width * out.height * 3;
-	out.data = (unsigned char *)malloc(data_size * sizeof(unsigned char));
+	unsigned long data_size = (unsigned long) out.width * out.height * imageComponents;
+	out.data = allocImage(data_size);
+	if (out.data == NULL)
+	{
+		freeImage(in.data);
+		return -1;
+	}
+	poolRun(pool, touchTask, out.data, (out.height + TILE_ROWS - 1) / TILE_ROWS);
 
 	printf("successfully Initialized output\n");
 
-	for(int i = 0; i < P; i++) {
-		pthread_create(&(tid[i]), NULL, applyFilter, &(interval[i]));
-	}
+	double begin = getTime();
 
-	// Join the threads
-	for(int i = 0; i < P; i++) {
-		pthread_join(tid[i], NULL);
+	if (planar && imageComponents > 1)
+	{
+		poolRun(pool, splitTask, NULL, (in.height + TILE_ROWS - 1) / TILE_ROWS);
+		poolRun(pool, filterPlanesTask, NULL, (in.height + TILE_ROWS - 1) / TILE_ROWS);
+		poolRun(pool, joinTask, NULL, (in.height + TILE_ROWS - 1) / TILE_ROWS);
 	}
+	else
+	{
+		poolRun(pool, applyFilter, NULL, (in.height + TILE_ROWS - 1) / TILE_ROWS);
+	}
+
+	if (numaMode)
+		reportNodeBandwidth(getTime() - begin);
 
 	printf("successfully applied filter\n");
 
-	writeData(argv[2], &out);
+	if (parallelEncode)
+		writeDataParallel(pool, outName);
+	else
+		writeData(outName, &out);
 
 	printf("successfully wrote data \n");
 
-	free(in.data);
-	free(out.data);
+	freeImage(in.data);
+	freeImage(out.data);
 
 	return 0;
 }
+
+//Grayscale of one tile of rows
+void grayTask(void *var, unsigned long tile)
+{
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS < in.height ? start + TILE_ROWS : in.height;
+
+	cannyGray(&edges, in.data + start * imageComponents * in.width, imageComponents, start, end);
+
+	if (numaMode)
+	{
+		addNodeBytes(in.data + start * imageComponents * in.width, imageComponents * (end - start) * in.width,
+					 imageComponents * (end - start) * in.width);
+		addNodeBytes(edges.gray + start * in.width, (end - start) * in.width, (end - start) * in.width);
+	}
+}
+
+//Run the stage in var on one tile of rows
+void stageTask(void *var, unsigned long tile)
+{
+	canny_stage stage = *(canny_stage *) var;
+	unsigned long start = tile * TILE_ROWS;
+	unsigned long end = start + TILE_ROWS < in.height ? start + TILE_ROWS : in.height;
+
+	stage(&edges, start, end);
+
+	// roughly a byte read and a byte written per pixel, on the node of the
+	// gray rows as long as the tile stays with the worker that wrote them
+	if (numaMode)
+		addNodeBytes(edges.gray + start * in.width, (end - start) * in.width, 2 * (end - start) * in.width);
+}
+
+static unsigned long stripStart(struct hysteresis *h, unsigned long k)
+{
+	return k * in.height / h->strips;
+}
+
+//Grow the strong pixels of strip k inside it
+void startTask(void *var, unsigned long k)
+{
+	struct hysteresis *h = (struct hysteresis *) var;
+
+	cannyStart(&edges, stripStart(h, k), stripStart(h, k + 1), &h->stacks[k]);
+}
+
+//Collect the weak pixels of strip k reached from the strips around it
+void seedTask(void *var, unsigned long k)
+{
+	struct hysteresis *h = (struct hysteresis *) var;
+	unsigned long count = cannySeeds(&edges, stripStart(h, k), stripStart(h, k + 1), &h->stacks[k]);
+
+	__atomic_add_fetch(&h->found, count, __ATOMIC_RELAXED);
+}
+
+void growTask(void *var, unsigned long k)
+{
+	struct hysteresis *h = (struct hysteresis *) var;
+
+	cannyGrow(&edges, stripStart(h, k), stripStart(h, k + 1), &h->stacks[k]);
+}
+
+//Canny edge map of one image: the stages run over tiles on the pool, one
+//after the other, then hysteresis over one strip per worker, in rounds
+//until no weak pixel next to a strip border is reached from the strip beside it
+int cannyImage(struct threadpool *pool, const char *inName, const char *outName)
+{
+	unsigned long tiles;
+	struct hysteresis h;
+	canny_stage stage;
+
+	in.data = NULL;
+	readInput(inName, &in, pool);
+	if (in.data == NULL)
+		return -1;
+
+	printf("successfully read input\n");
+
+	h.strips = poolSize(pool);
+	h.stacks = (struct seedList *) calloc(h.strips, sizeof(struct seedList));
+	if (h.stacks == NULL ||
+		cannyAlloc(&edges, in.width, in.height, 0, in.height, cannyLow, cannyHigh) != 0)
+	{
+		fprintf(stderr, "can't allocate the edge detector\n");
+		free(h.stacks);
+		freeImage(in.data);
+		return -1;
+	}
+
+	double begin = getTime();
+
+	tiles = (in.height + TILE_ROWS - 1) / TILE_ROWS;
+	poolRun(pool, grayTask, NULL, tiles);
+	stage = cannySmooth;
+	poolRun(pool, stageTask, &stage, tiles);
+	stage = cannyGradient;
+	poolRun(pool, stageTask, &stage, tiles);
+	stage = cannySuppress;
+	poolRun(pool, stageTask, &stage, tiles);
+
+	poolRun(pool, startTask, &h, h.strips);
+	while (1)
+	{
+		h.found = 0;
+		poolRun(pool, seedTask, &h, h.strips);
+		if (h.found == 0)
+			break;
+		poolRun(pool, growTask, &h, h.strips);
+	}
+
+	if (numaMode)
+		reportNodeBandwidth(getTime() - begin);
+
+	printf("successfully applied filter\n");
+	printf("Output image width and height: %lu %lu\n", in.width, in.height);
+
+	int result = writeEdgeMap(&edges, outName);
+
+	if (result == 0)
+		printf("successfully wrote data \n");
+
+	for (int k = 0; k < h.strips; k++)
+		freeSeeds(&h.stacks[k]);
+	free(h.stacks);
+	cannyFree(&edges);
+	freeImage(in.data);
+
+	return result;
+}
+
+// Small images of a batch run, one per pool task
+struct batchRun
+{
+	struct batch *b;
+	int failed;
+};
+
+//Filter a small image of the batch whole, on the calling worker
+void batchTask(void *arg, unsigned long k)
+{
+	struct batchRun *run = (struct batchRun *) arg;
+
+	if (run->b->large[k])
+		return;
+
+	if (filterImage(run->b->inputs[k], run->b->outputs[k]) != 0)
+	{
+		fprintf(stderr, "can't filter %s\n", run->b->inputs[k]);
+		__atomic_add_fetch(&run->failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+//Filter the images of a batch: the small ones several at once, each on one
+//worker, then the large ones one at a time with all the workers
+int runBatch(struct threadpool *pool, const char *source, const char *outDir,
+			 int pipelined, int parallelEncode)
+{
+	struct batch b;
+	struct batchRun run = {&b, 0};
+
+	if (readBatch(source, outDir, &b) != 0 || classifyBatch(&b) != 0)
+		return -1;
+
+	printSizes = 0;
+	double begin = getTime();
+
+	poolRun(pool, batchTask, &run, b.count);
+
+	for (int k = 0; k < b.count; k++)
+	{
+		if (!b.large[k])
+			continue;
+
+		if (pipelined ? pipelineFilter(pool, b.inputs[k], b.outputs[k]) != 0
+					  : processImage(pool, b.inputs[k], b.outputs[k], parallelEncode) != 0)
+			run.failed++;
+	}
+
+	reportBatch(b.count - run.failed, run.failed, getTime() - begin);
+	freeBatch(&b);
+
+	return run.failed == 0 ? 0 : -1;
+}
+
+int main(int argc, char * argv[]) {
+	struct threadpool *pool;
+	int opt;
+	int pipelined = 0;
+	int parallelEncode = 0;
+	int batchMode = 0;
+
+	while ((opt = getopt(argc, argv, "m:k:pebnt:c:gL:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			if (setFilterMode(optarg) != 0)
+			{
+				fprintf(stderr, "unknown filter mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			if (setFilterKernel(optarg) != 0)
+			{
+				return -1;
+			}
+			break;
+		case 'p':
+			pipelined = 1;
+			break;
+		case 'e':
+			parallelEncode = 1;
+			break;
+		case 'b':
+			batchMode = 1;
+			break;
+		case 'n':
+			numaMode = 1;
+			initPinning();
+			break;
+		case 't':
+			P = atoi(optarg);
+			break;
+		case 'g':
+			imageComponents = 1;
+			break;
+		case 'L':
+			if (strcmp(optarg, "planar") == 0)
+				planar = 1;
+			else if (strcmp(optarg, "interleaved") == 0)
+				planar = 0;
+			else
+			{
+				fprintf(stderr, "unknown layout %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			if (parseThresholds(optarg, &cannyLow, &cannyHigh) != 0)
+			{
+				fprintf(stderr, "bad thresholds %s, expected low:high up to 2040\n", optarg);
+				return -1;
+			}
+			cannyMode = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-p] [-e] [-n] [-g] [-L interleaved|planar] [-t threads] [-b] [-c low:high] <image_in> <image_out> ...\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind < 2 || (argc - optind) % 2 != 0 || (batchMode && argc - optind != 2))
+	{
+		fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-p] [-e] [-n] [-g] [-L interleaved|planar] [-t threads] [-b] [-c low:high] <image_in> <image_out> ...\n", argv[0]);
+		return -1;
+	}
+
+	if (P <= 0)
+		P = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (P <= 0)
+		P = 1;
+
+	if (cannyMode && (batchMode || pipelined))
+	{
+		fprintf(stderr, "-c works on single images, -b and -p are ignored\n");
+		batchMode = 0;
+		pipelined = 0;
+	}
+
+	// the pipeline filters interleaved rows as they come and encodes them on
+	// one thread
+	if (pipelined && (planar || parallelEncode))
+	{
+		fprintf(stderr, "-p can't be combined with -L planar or -e\n");
+		return -1;
+	}
+
+	// the small images of a batch keep every worker busy, one image each
+	if (batchMode)
+	{
+		int result;
+
+		pool = poolCreate(P);
+		if (pool == NULL)
+			return -1;
+		if (numaMode && poolPin(pool) != 0)
+			printf("can't pin the workers\n");
+
+		result = runBatch(pool, argv[optind], argv[optind + 1], pipelined, parallelEncode);
+		poolDestroy(pool);
+
+		return result;
+	}
+
+	// the workers stay alive for all the images
+	pool = poolCreate(P);
+	if (pool == NULL)
+		return -1;
+	if (numaMode && poolPin(pool) != 0)
+		printf("can't pin the workers\n");
+
+	int result = 0;
+
+	for (int arg = optind; arg + 1 < argc && result == 0; arg += 2)
+	{
+		// decode, filter and encode concurrently
+		if (pipelined)
+		{
+			result = pipelineFilter(pool, argv[arg], argv[arg + 1]);
+			if (result == 0)
+				printf("successfully wrote data \n");
+		}
+		else if (cannyMode)
+		{
+			result = cannyImage(pool, argv[arg], argv[arg + 1]);
+		}
+		else
+		{
+			result = processImage(pool, argv[arg], argv[arg + 1], parallelEncode);
+		}
+	}
+
+	poolDestroy(pool);
+
+	return result;
+}
@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "libjpeg/jpeglib.h"
+#include "filter.h"
+#include "jpegio.h"
+#include "batch.h"
+#include "imagebuf.h"
 
 typedef struct {
 	int width;
@@ -9,10 +14,7 @@ typedef struct {
 	unsigned char *data;
 } image;
 
-// Gaussian noise reduction (sum /= 16)
-int edgeDetectionFilter[3][3] = {{-1, -1, -1},
-								 {-1, 8, -1},
-								 {-1, -1, -1}};
+int planar = 0;	// filter every channel as a plane of its own
 
 
 //Read a given image
@@ -41,24 +43,34 @@ void readInput(const char *fileName, image *img)
  	//read the header    
   	jpeg_read_header(&info, TRUE);
 
+	//decode straight to luminance with -g
+	info.out_color_space = imageColorSpace();
+
   	// start decompression
   	jpeg_start_decompress(&info);
 
 	//get width and height
 	img->width = info.output_width;
 	img->height = info.output_height;
-	unsigned long data_size = (unsigned long)img->width * img->height * 3;
+	unsigned long data_size = (unsigned long)img->width * img->height * imageComponents;
     unsigned char* rowptr[1];
     unsigned char* jdata;
 
 	printf("Input image width and height: %d %d\n", (*img).width, (*img).height);
 
-	img->data = (unsigned char*)malloc(data_size * sizeof(unsigned char));
+	img->data = allocImage(data_size);
+	if (img->data == NULL)
+	{
+		fprintf(stderr, "can't allocate the image\n");
+		jpeg_destroy_decompress(&info);
+		fclose(input);
+		return;
+	}
 
 	while (info.output_scanline < info.output_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data 
-	    			+ 3 * info.output_width * info.output_scanline; 
+	    			+ imageComponents * info.output_width * info.output_scanline; 
 
 	    jpeg_read_scanlines(&info, rowptr, 1);
 	}
@@ -96,8 +108,8 @@ void writeData(const char *fileName, image *img)
 	//set width and height
 	info.image_width = img->width;
 	info.image_height = img->height;
-	info.input_components = 3;
-    info.in_color_space = JCS_RGB;
+	info.input_components = imageComponents;
+    info.in_color_space = imageColorSpace();
     info.err = jpeg_std_error(&jerr); 
 	
   	unsigned char* rowptr[1];
@@ -111,7 +123,7 @@ void writeData(const char *fileName, image *img)
 	while (info.next_scanline < info.image_height)
 	{
 	    rowptr[0] = (unsigned char *)img->data
-		            + 3 * info.image_width * info.next_scanline; 
+		            + imageComponents * info.image_width * info.next_scanline; 
 
 	    jpeg_write_scanlines(&info, rowptr, 1);
 	}
@@ -123,57 +135,231 @@ void writeData(const char *fileName, image *img)
 	jpeg_destroy_compress(&info);
 }
 
-//Compute sum of neighbours product
-int computeSum(unsigned long row, unsigned long column, image *in)
+//Apply filter
+//Planar: out holds the planes while the filtered ones go to in, which is
+//not needed any more, and are joined back into out
+void applyFilter(image *in, image *out)
 {
-	int sum = 0;
-	unsigned long rowIdx = row - 1;
-	unsigned long colIdx = column - 3;
-
-	for (unsigned long i = rowIdx, fi = 0; i < rowIdx + 3; i++, fi++)
+	if (planar && imageComponents > 1)
 	{
-		for (unsigned long j = colIdx, fj = 0; j < colIdx + 9; j += 3, fj++)
-		{
-			sum += (int)(in->data[i * 3 * in->width + j]) * edgeDetectionFilter[fi][fj];
-		}
+		deinterleaveRows(in->data, out->data, in->width, in->height, imageComponents, 0, in->height);
+		filterPlanes(out->data, in->data, in->width, in->height, imageComponents, 0, in->height);
+		interleaveRows(in->data, out->data, in->width, in->height, imageComponents, 0, in->height);
+		return;
 	}
 
-	return sum;
+	filterRows(in->data, out->data, in->width, in->height, imageComponents, 0, in->height);
 }
 
-//Apply filter
-void applyFilter(image *in, image *out)
+//Decode, filter and encode row by row, keeping only 3 input rows in memory
+int streamFilter(const char *inName, const char *outName)
 {
-	for (unsigned long i = 0; i < in->height; i++)
+	FILE *input = NULL;
+	FILE *output = NULL;
+	struct jpeg_decompress_struct inInfo;
+	struct jpeg_compress_struct outInfo;
+	struct jpeg_error_mgr inErr;
+	struct jpeg_error_mgr outErr;
+	unsigned char *ring[2 * FILTER_MAX_RADIUS + 1];
+	const unsigned char *window[2 * FILTER_MAX_RADIUS + 1];
+	unsigned char *filtered;
+	unsigned char *rowptr[1];
+
+	if (inName == NULL ||
+		(input = fopen(inName, "rb")) == NULL)
 	{
-		for (unsigned long j = 0; j < 3 * in->width; j++)
+		fprintf(stderr, "can't open %s\n", inName);
+		return -1;
+	}
+
+	if ((output = fopen(outName, "wb")) == NULL)
+	{
+		fprintf(stderr, "can't open %s\n", outName);
+		fclose(input);
+		return -1;
+	}
+
+	inInfo.err = jpeg_std_error(&inErr);
+	jpeg_create_decompress(&inInfo);
+	jpeg_stdio_src(&inInfo, input);
+	jpeg_read_header(&inInfo, TRUE);
+	inInfo.out_color_space = imageColorSpace();
+	jpeg_start_decompress(&inInfo);
+
+	unsigned long width = inInfo.output_width;
+	unsigned long height = inInfo.output_height;
+	unsigned long rowSize = imageComponents * width;
+	unsigned long radius = filterRadius();
+	unsigned long taps = 2 * radius + 1;
+
+	printf("Input image width and height: %lu %lu\n", width, height);
+
+	outInfo.err = jpeg_std_error(&outErr);
+	jpeg_create_compress(&outInfo);
+	jpeg_stdio_dest(&outInfo, output);
+	outInfo.image_width = width;
+	outInfo.image_height = height;
+	outInfo.input_components = imageComponents;
+	outInfo.in_color_space = imageColorSpace();
+	jpeg_set_defaults(&outInfo);
+	jpeg_start_compress(&outInfo, TRUE);
+
+	//Ring buffer of the rows the kernel reads: row i lives in ring[i % taps]
+	ring[0] = (unsigned char *)malloc((taps + 1) * rowSize * sizeof(unsigned char));
+	if (ring[0] == NULL)
+	{
+		fprintf(stderr, "can't allocate the row buffers\n");
+		exit(1);
+	}
+	for (unsigned long t = 1; t < taps; t++)
+		ring[t] = ring[t - 1] + rowSize;
+	filtered = ring[taps - 1] + rowSize;
+
+	for (unsigned long i = 0; i < height; i++)
+	{
+		//Make sure row i + radius is decoded; it replaces row i - radius - 1
+		while (inInfo.output_scanline < height && inInfo.output_scanline <= i + radius)
 		{
-			//Border case
-			if (i < 1 || i >= in->height - 1 ||
-				j < 3 || j >= 3 * in->width - 3)
-			{
-				out->data[i *  3 * in->width + j] = in->data[i * 3 * in->width + j];
-				continue;
-			}
+			rowptr[0] = ring[inInfo.output_scanline % taps];
+			jpeg_read_scanlines(&inInfo, rowptr, 1);
+		}
 
-			out->data[i * 3 * in->width + j] = (unsigned char)(computeSum(i, j, in) / 16);
+		//Border rows are written unchanged
+		if (i < radius || i + radius >= height)
+		{
+			rowptr[0] = ring[i % taps];
+		}
+		else
+		{
+			for (unsigned long t = 0; t < taps; t++)
+				window[t] = ring[(i - radius + t) % taps];
+			filterWindow(window, filtered, width, imageComponents);
+			rowptr[0] = filtered;
 		}
+
+		jpeg_write_scanlines(&outInfo, rowptr, 1);
 	}
+
+	printf("Output image width and height: %lu %lu\n", width, height);
+
+	jpeg_finish_decompress(&inInfo);
+	jpeg_destroy_decompress(&inInfo);
+	fclose(input);
+
+	jpeg_finish_compress(&outInfo);
+	jpeg_destroy_compress(&outInfo);
+	fclose(output);
+
+	free(ring[0]);
+
+	return 0;
 }
 
 
 int main(int argc, char * argv[]) {
 	image in;
 	image out;
+	int opt;
+	int stream = 0;
+	int batchMode = 0;
+
+	while ((opt = getopt(argc, argv, "m:k:sbgL:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			if (setFilterMode(optarg) != 0)
+			{
+				fprintf(stderr, "unknown filter mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			if (setFilterKernel(optarg) != 0)
+			{
+				return -1;
+			}
+			break;
+		case 's':
+			stream = 1;
+			break;
+		case 'b':
+			batchMode = 1;
+			break;
+		case 'g':
+			imageComponents = 1;
+			break;
+		case 'L':
+			if (strcmp(optarg, "planar") == 0)
+				planar = 1;
+			else if (strcmp(optarg, "interleaved") == 0)
+				planar = 0;
+			else
+			{
+				fprintf(stderr, "unknown layout %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-s] [-b] [-g] [-L interleaved|planar] <image_in|batch> <image_out|dir>\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind < 2)
+	{
+		fprintf(stderr, "usage: %s [-m scalar|simd|boxsum|tiled] [-k kernel] [-s] [-b] [-g] [-L interleaved|planar] <image_in|batch> <image_out|dir>\n", argv[0]);
+		return -1;
+	}
 
-	readInput(argv[1], &in);
+	// batch mode, the images of a manifest or directory one after another
+	if (batchMode)
+	{
+		struct batch b;
+		int failed = 0;
+
+		if (readBatch(argv[optind], argv[optind + 1], &b) != 0)
+			return -1;
+
+		printSizes = 0;
+		double begin = getTime();
+
+		for (int k = 0; k < b.count; k++)
+		{
+			if (filterImage(b.inputs[k], b.outputs[k]) != 0)
+			{
+				fprintf(stderr, "can't filter %s\n", b.inputs[k]);
+				failed++;
+			}
+		}
+
+		reportBatch(b.count - failed, failed, getTime() - begin);
+		freeBatch(&b);
+
+		return failed == 0 ? 0 : -1;
+	}
+
+	// streaming mode, O(width) memory instead of two full images
+	if (stream)
+	{
+		if (streamFilter(argv[optind], argv[optind + 1]) != 0)
+			return -1;
+
+		printf("successfully wrote data \n");
+		return 0;
+	}
+
+	in.data = NULL;
+	readInput(argv[optind], &in);
+	if (in.data == NULL)
+		return -1;
 
 	printf("successfully read input\n");
 	
 	out.height = in.height;
 	out.width = in.width;
-	unsigned long data_size = (unsigned long) out.width * out.height * 3;
-	out.data = (unsigned char*)malloc(data_size * sizeof(unsigned char));
+	unsigned long data_size = (unsigned long) out.width * out.height * imageComponents;
+	out.data = allocImage(data_size);
 	if (out.data == NULL)
 		return -1;
 
@@ -183,12 +369,12 @@ int main(int argc, char * argv[]) {
 
 	printf("successfully applied filter\n");
 
-	writeData(argv[2], &out);
+	writeData(argv[optind + 1], &out);
 
 	printf("successfully wrote data \n");
 
-	free(in.data);
-	free(out.data);
+	freeImage(in.data);
+	freeImage(out.data);
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "threadpool.h"
+#include "numa.h"
+
+// Task indices [head, tail) owned by one worker; the owner pops from the
+// head, thieves take the upper half
+struct deque
+{
+	pthread_mutex_t lock;
+	unsigned long head;
+	unsigned long tail;
+};
+
+struct worker
+{
+	struct threadpool *pool;
+	int id;
+};
+
+struct threadpool
+{
+	int size;
+	pthread_t *threads;
+	struct worker *workers;
+	struct deque *deques;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// a new job was posted or the pool stops
+	pthread_cond_t idle;		// a job finished or the last worker left it
+	unsigned long generation;
+	int shutdown;
+	task_fn fn;
+	void *arg;
+	unsigned long pending;		// tasks of the current job not finished yet
+	int running;				// workers inside runTasks
+};
+
+//Take the next task of the worker's own share
+static int popTask(struct deque *dq, unsigned long *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head < dq->tail)
+	{
+		*task = dq->head++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return found;
+}
+
+//Move half of another worker's remaining share into our own deque
+//Only called once our own deque is empty; poolRun doesn't seed the deques
+//again until every worker has left runTasks, so it stays empty
+static int stealTask(struct threadpool *pool, int id, unsigned long *task)
+{
+	for (int k = 1; k < pool->size; k++)
+	{
+		struct deque *victim = &pool->deques[(id + k) % pool->size];
+		unsigned long start, end;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head >= victim->tail)
+		{
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		end = victim->tail;
+		start = victim->head + (victim->tail - victim->head) / 2;
+		victim->tail = start;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&pool->deques[id].lock);
+		pool->deques[id].head = start + 1;
+		pool->deques[id].tail = end;
+		pthread_mutex_unlock(&pool->deques[id].lock);
+
+		*task = start;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void runTasks(struct threadpool *pool, int id)
+{
+	unsigned long task;
+
+	while (popTask(&pool->deques[id], &task) || stealTask(pool, id, &task))
+	{
+		pool->fn(pool->arg, task);
+
+		if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		{
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_broadcast(&pool->idle);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+}
+
+static void* workerLoop(void *var)
+{
+	struct worker *self = (struct worker *) var;
+	struct threadpool *pool = self->pool;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (!pool->shutdown && pool->generation == seen)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->shutdown)
+			break;
+
+		seen = pool->generation;
+		pool->running++;
+		pthread_mutex_unlock(&pool->lock);
+
+		runTasks(pool, self->id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct threadpool *poolCreate(int threads)
+{
+	struct threadpool *pool;
+
+	if (threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	pool = (struct threadpool *)calloc(1, sizeof(struct threadpool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->size = threads;
+	pool->threads = (pthread_t *)malloc(threads * sizeof(pthread_t));
+	pool->workers = (struct worker *)malloc(threads * sizeof(struct worker));
+	pool->deques = (struct deque *)calloc(threads, sizeof(struct deque));
+	if (pool->threads == NULL || pool->workers == NULL || pool->deques == NULL)
+	{
+		free(pool->threads);
+		free(pool->workers);
+		free(pool->deques);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pthread_create(&pool->threads[i], NULL, workerLoop, &pool->workers[i]);
+	}
+
+	return pool;
+}
+
+int poolSize(struct threadpool *pool)
+{
+	return pool->size;
+}
+
+int poolPin(struct threadpool *pool)
+{
+	int result = 0;
+
+	for (int i = 0; i < pool->size; i++)
+	{
+		int cpu = getWorkerCpu(i, pool->size);
+		cpu_set_t set;
+
+		if (cpu < 0)
+			return -1;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(pool->threads[i], sizeof(set), &set) != 0)
+			result = -1;
+	}
+
+	return result;
+}
+
+void poolRun(struct threadpool *pool, task_fn fn, void *arg, unsigned long count)
+{
+	if (count == 0)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+
+	// a worker of the previous job may still be on its way out of
+	// runTasks; reseeding under it would let a late steal drop a share
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+
+	pool->fn = fn;
+	pool->arg = arg;
+	__atomic_store_n(&pool->pending, count, __ATOMIC_RELEASE);
+
+	// contiguous shares first, so neighbouring tiles stay on one worker
+	for (int i = 0; i < pool->size; i++)
+	{
+		pthread_mutex_lock(&pool->deques[i].lock);
+		pool->deques[i].head = i * count / pool->size;
+		pool->deques[i].tail = (i + 1) * count / pool->size;
+		pthread_mutex_unlock(&pool->deques[i].lock);
+	}
+
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+
+	while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void poolDestroy(struct threadpool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->size; i++)
+	{
+		pthread_join(pool->threads[i], NULL);
+		pthread_mutex_destroy(&pool->deques[i].lock);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->threads);
+	free(pool->workers);
+	free(pool->deques);
+	free(pool);
+}
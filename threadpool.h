@@ -0,0 +1,28 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Task body: called once for every index of a poolRun job
+typedef void (*task_fn)(void *arg, unsigned long index);
+
+struct threadpool;
+
+//Start a pool of persistent workers; threads <= 0 uses one per online CPU
+struct threadpool *poolCreate(int threads);
+
+//Number of workers in the pool
+int poolSize(struct threadpool *pool);
+
+//Pin every worker to a CPU of its own, spread over the sockets
+//(initPinning must have run first)
+//Returns 0 on success and -1 if a worker couldn't be pinned
+int poolPin(struct threadpool *pool);
+
+//Run fn(arg, i) for every i in [0, count) and wait until all of them are done
+//Each worker starts on a contiguous share of the indices and steals half of
+//another worker's remaining share when it runs out
+void poolRun(struct threadpool *pool, task_fn fn, void *arg, unsigned long count);
+
+//Stop and join the workers
+void poolDestroy(struct threadpool *pool);
+
+#endif